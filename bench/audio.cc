@@ -0,0 +1,246 @@
+/*
+ * Copyright © 2016  Rinat Ibragimov
+ *
+ * This file is part of gmp-widevine.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+// Audio conversion benchmark: checks audio::convert_to_s16() against a plain scalar reference
+// and times both, for each CDM sample format at 1, 2, 6 and 8 channels. CDM has no planar U8 or
+// S32 formats, so those are only covered interleaved. Exits with non-zero status on mismatch.
+//
+// Usage: bench-audio [frames per buffer] [iterations]
+
+#include <src/audio.hh>
+#include <boost/format.hpp>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <limits>
+#include <random>
+#include <vector>
+
+using boost::format;
+
+namespace {
+
+struct Format {
+    cdm::AudioFormat    fmt;
+    const char         *name;
+    bool                planar;
+};
+
+const Format formats[] = {
+    {cdm::kAudioFormatU8,           "U8",           false},
+    {cdm::kAudioFormatS16,          "S16",          false},
+    {cdm::kAudioFormatS32,          "S32",          false},
+    {cdm::kAudioFormatF32,          "F32",          false},
+    {cdm::kAudioFormatPlanarS16,    "PlanarS16",    true},
+    {cdm::kAudioFormatPlanarF32,    "PlanarF32",    true},
+};
+
+const uint32_t channel_counts[] = {1, 2, 6, 8};
+
+int16_t
+ref_sample(cdm::AudioFormat fmt, const uint8_t *p)
+{
+    switch (fmt) {
+    case cdm::kAudioFormatU8:
+        return static_cast<int16_t>((p[0] - 128) * 256);
+
+    case cdm::kAudioFormatS16:
+    case cdm::kAudioFormatPlanarS16: {
+        int16_t s;
+        memcpy(&s, p, sizeof(s));
+        return s;
+    }
+
+    case cdm::kAudioFormatS32: {
+        int32_t s;
+        memcpy(&s, p, sizeof(s));
+        return static_cast<int16_t>(s / 65536 - (s % 65536 < 0 ? 1 : 0));
+    }
+
+    case cdm::kAudioFormatF32:
+    case cdm::kAudioFormatPlanarF32: {
+        float s;
+        memcpy(&s, p, sizeof(s));
+        if (std::isnan(s))
+            return 32767;
+
+        const float v = s * 32768.0f;
+        if (v >= 32767.0f)
+            return 32767;
+        if (v <= -32768.0f)
+            return -32768;
+        return static_cast<int16_t>(lrintf(v));
+    }
+
+    default:
+        return 0;
+    }
+}
+
+// Scalar reference, one sample at a time.
+void
+ref_convert(const Format &f, const uint8_t *src, uint32_t channels, uint32_t frames,
+            int16_t *dst)
+{
+    const uint32_t bps = audio::bytes_per_sample(f.fmt);
+
+    for (uint32_t k = 0; k < frames; k ++) {
+        for (uint32_t ch = 0; ch < channels; ch ++) {
+            const size_t idx = f.planar ? size_t(ch) * frames + k : size_t(k) * channels + ch;
+            dst[size_t(k) * channels + ch] = ref_sample(f.fmt, src + idx * bps);
+        }
+    }
+}
+
+// Random samples over the full range, with some edge values mixed in.
+std::vector<uint8_t>
+make_input(const Format &f, size_t count, std::mt19937 &rng)
+{
+    const uint32_t bps = audio::bytes_per_sample(f.fmt);
+    std::vector<uint8_t> buf(count * bps);
+
+    const bool is_float = (f.fmt == cdm::kAudioFormatF32 || f.fmt == cdm::kAudioFormatPlanarF32);
+    const float float_edges[] = {0.0f, -0.0f, 1.0f, -1.0f, 32767.0f / 32768.0f, 1.5f, -1.5f,
+                                 1e10f, -1e10f, 0.5f / 32768.0f, 1.5f / 32768.0f,
+                                 std::numeric_limits<float>::infinity(),
+                                 -std::numeric_limits<float>::infinity(),
+                                 std::numeric_limits<float>::quiet_NaN()};
+    std::uniform_real_distribution<float> float_dist(-1.1f, 1.1f);
+
+    for (size_t k = 0; k < count; k ++) {
+        uint8_t *p = buf.data() + k * bps;
+
+        if (is_float) {
+            const float v = (k % 7 == 3) ? float_edges[(k / 7) % (sizeof(float_edges) / sizeof(float))]
+                                         : float_dist(rng);
+            memcpy(p, &v, sizeof(v));
+        } else {
+            const uint32_t r = rng();
+            memcpy(p, &r, bps);
+        }
+    }
+
+    return buf;
+}
+
+bool
+check(const Format &f, uint32_t channels, uint32_t frames, std::mt19937 &rng)
+{
+    const size_t count = size_t(channels) * frames;
+    const std::vector<uint8_t> src = make_input(f, count, rng);
+
+    // guard values after the end catch overruns
+    std::vector<int16_t> expected(count + 16, 0x5a5a);
+    std::vector<int16_t> actual(count + 16, 0x5a5a);
+
+    ref_convert(f, src.data(), channels, frames, expected.data());
+    if (!audio::convert_to_s16(f.fmt, src.data(), channels, frames, actual.data())) {
+        std::cout << format("%1%, %2% channels: not supported\n") % f.name % channels;
+        return false;
+    }
+
+    for (size_t k = 0; k < expected.size(); k ++) {
+        if (expected[k] != actual[k]) {
+            std::cout << format("%1%, %2% channels, %3% frames: mismatch at sample %4%, "
+                         "expected %5%, got %6%\n") % f.name % channels % frames % k %
+                         expected[k] % actual[k];
+            return false;
+        }
+    }
+
+    return true;
+}
+
+template <typename Func>
+double
+ns_per_frame(Func func, uint32_t frames, uint32_t iterations)
+{
+    func();     // warm up
+
+    const auto start = std::chrono::steady_clock::now();
+    for (uint32_t k = 0; k < iterations; k ++)
+        func();
+    const auto end = std::chrono::steady_clock::now();
+
+    return std::chrono::duration<double, std::nano>(end - start).count() /
+           (double(iterations) * frames);
+}
+
+} // namespace
+
+int
+main(int argc, char *argv[])
+{
+    uint32_t frames = 1024;     // an AAC frame
+    uint32_t iterations = 20000;
+
+    if (argc > 1)
+        frames = std::max(1, atoi(argv[1]));
+    if (argc > 2)
+        iterations = std::max(1, atoi(argv[2]));
+
+    std::mt19937 rng(12345);
+    bool ok = true;
+
+    // sizes around SIMD block boundaries, so tails are exercised
+    const uint32_t check_frames[] = {0, 1, 3, 7, 8, 9, 15, 16, 17, 31, 33, 63, 100, 1023, frames};
+
+    for (const auto &f: formats) {
+        for (auto channels: channel_counts) {
+            for (auto n: check_frames)
+                ok = check(f, channels, n, rng) && ok;
+        }
+    }
+
+    std::cout << (ok ? "output matches scalar reference\n" : "OUTPUT MISMATCH\n");
+
+    std::cout << format("%1% frames per buffer, %2% iterations\n") % frames % iterations;
+    std::cout << format("%-10s %8s %13s %13s %8s\n") % "format" % "channels" % "scalar ns/fr" %
+                 "convert ns/fr" % "speedup";
+
+    for (const auto &f: formats) {
+        for (auto channels: channel_counts) {
+            const size_t count = size_t(channels) * frames;
+            const std::vector<uint8_t> src = make_input(f, count, rng);
+            std::vector<int16_t> dst(count);
+
+            // iteration count is scaled, so every row takes about the same time
+            const uint32_t n = std::max(1u, iterations / channels);
+
+            const double ref_ns = ns_per_frame([&] {
+                    ref_convert(f, src.data(), channels, frames, dst.data());
+                }, frames, n);
+            const double conv_ns = ns_per_frame([&] {
+                    audio::convert_to_s16(f.fmt, src.data(), channels, frames, dst.data());
+                }, frames, n);
+
+            std::cout << format("%-10s %8u %13.2f %13.2f %7.1fx\n") % f.name % channels % ref_ns %
+                         conv_ns % (ref_ns / conv_ns);
+        }
+    }
+
+    return ok ? 0 : 1;
+}
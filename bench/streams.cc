@@ -0,0 +1,249 @@
+/*
+ * Copyright © 2016  Rinat Ibragimov
+ *
+ * This file is part of gmp-widevine.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+// Multi-stream benchmark: how aggregate decode throughput scales with the number of concurrent
+// video streams, with CDM calls scheduled the way the plugin does it.
+//
+// There is no CDM here, so its calls are modelled by a fixed amount of work: decoding produces a
+// YV12 frame with per-pixel work, decrypting copies a compressed frame. Each stream runs on its
+// own thread, like a VideoDecoder worker. The first stream decodes on the main CDM instance
+// with a single call; every other stream has an instance of its own, so it makes two calls per
+// frame, Decrypt() on the main instance and a clear decode on its own one. Each call holds CDM
+// lock for its duration, as crcdm::Instance does, and decoded frames are repacked with the
+// plugin's own planes code after the lock is released. Two locking schemes are compared:
+//   cdm-lock      one lock for all instances, as the plugin does
+//   per-instance  a lock per instance; upper bound, if CDM instances were independent
+//
+// Usage: bench-streams [frames per stream] [width] [height]
+
+#include <src/planes.hh>
+#include <boost/format.hpp>
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using boost::format;
+using std::chrono::steady_clock;
+
+namespace {
+
+uint32_t frames_per_stream = 120;
+int32_t  frame_width = 1280;
+int32_t  frame_height = 720;
+
+// compressed frame size; roughly 4 Mbit/s at 30 fps
+const size_t kCompressedFrameSize = 16 * 1024;
+
+double
+ms_between(steady_clock::time_point a, steady_clock::time_point b)
+{
+    return std::chrono::duration<double, std::milli>(b - a).count();
+}
+
+// Stands in for a CDM instance. Its methods are only called through LockedCdm; |lock| is the
+// lock it holds meanwhile.
+class FakeCdm
+{
+public:
+    explicit FakeCdm(std::recursive_mutex &lock)
+        : lock_(lock)
+    {}
+
+    std::recursive_mutex &
+    lock() { return lock_; }
+
+    void
+    decrypt(const std::vector<uint8_t> &in, std::vector<uint8_t> &out)
+    {
+        out.resize(in.size());
+        for (size_t k = 0; k < in.size(); k ++)
+            out[k] = in[k] ^ static_cast<uint8_t>(k * 131);
+    }
+
+    void
+    decode(uint32_t seed, std::vector<uint8_t> &yv12)
+    {
+        const size_t luma = static_cast<size_t>(frame_width) * frame_height;
+        yv12.resize(luma + luma / 2);
+
+        uint32_t x = seed * 2654435761u;
+        for (size_t k = 0; k < yv12.size(); k ++) {
+            x ^= x << 13;
+            x ^= x >> 17;
+            x ^= x << 5;
+            yv12[k] = static_cast<uint8_t>(x);
+        }
+    }
+
+private:
+    std::recursive_mutex &lock_;
+};
+
+// Same as crcdm::Instance, but for FakeCdm.
+class LockedCdm final
+{
+public:
+    explicit LockedCdm(FakeCdm *cdm)
+        : lock_(cdm->lock())
+        , cdm_(cdm)
+    {}
+
+    FakeCdm *
+    operator->() const { return cdm_; }
+
+private:
+    std::unique_lock<std::recursive_mutex>  lock_;
+    FakeCdm                                *cdm_;
+};
+
+struct Stream {
+    uint32_t                    id;
+    FakeCdm                    *main_cdm;
+    FakeCdm                    *own_cdm;        // null for the stream on the main instance
+    steady_clock::time_point    first_frame;
+    steady_clock::time_point    last_frame;
+};
+
+void
+decode_frame(Stream &s, uint32_t k, const std::vector<uint8_t> &sample,
+             std::vector<uint8_t> &clear, std::vector<uint8_t> &yv12)
+{
+    if (s.own_cdm) {
+        LockedCdm(s.main_cdm)->decrypt(sample, clear);
+        LockedCdm(s.own_cdm)->decode(s.id * 100003 + k, yv12);
+    } else {
+        // DecryptAndDecodeFrame(): decryption and decoding in one call
+        LockedCdm cdm(s.main_cdm);
+        cdm->decrypt(sample, clear);
+        cdm->decode(s.id * 100003 + k, yv12);
+    }
+
+    const uint32_t w = frame_width;
+    const uint32_t h = frame_height;
+    const uint8_t *y = yv12.data();
+    const uint8_t *v = y + w * h;
+    const uint8_t *u = v + (w / 2) * (h / 2);
+
+    auto img = planes::repack_i420(w, h, planes::PlaneRef{y, w}, planes::PlaneRef{u, w / 2},
+                                   planes::PlaneRef{v, w / 2});
+    if (!img) {
+        std::cerr << "allocation failed\n";
+        exit(1);
+    }
+
+    if (k == 0)
+        s.first_frame = steady_clock::now();
+    s.last_frame = steady_clock::now();
+}
+
+void
+run_stream(Stream &s)
+{
+    std::vector<uint8_t> sample(kCompressedFrameSize, static_cast<uint8_t>(s.id));
+    std::vector<uint8_t> clear;
+    std::vector<uint8_t> yv12;
+
+    for (uint32_t k = 0; k < frames_per_stream; k ++)
+        decode_frame(s, k, sample, clear, yv12);
+}
+
+void
+run(uint32_t stream_count, bool shared_lock)
+{
+    // one lock per instance, of which only the first is used with a shared lock
+    std::vector<std::unique_ptr<std::recursive_mutex>> locks;
+    std::vector<std::unique_ptr<FakeCdm>> instances;
+
+    for (uint32_t k = 0; k < stream_count; k ++) {
+        locks.emplace_back(new std::recursive_mutex);
+        instances.emplace_back(new FakeCdm(shared_lock ? *locks[0] : *locks[k]));
+    }
+
+    std::vector<Stream> streams(stream_count);
+    std::vector<std::thread> threads;
+
+    const auto start = steady_clock::now();
+
+    for (uint32_t k = 0; k < stream_count; k ++) {
+        streams[k].id = k;
+        streams[k].main_cdm = instances[0].get();
+        streams[k].own_cdm = (k > 0) ? instances[k].get() : nullptr;
+        threads.emplace_back(run_stream, std::ref(streams[k]));
+    }
+
+    for (auto &t: threads)
+        t.join();
+
+    const auto end = steady_clock::now();
+
+    double first_frame_ms_sum = 0;
+    double first_frame_ms_max = 0;
+    double stream_fps_min = 1e9;
+
+    for (const auto &s: streams) {
+        const double first_ms = ms_between(start, s.first_frame);
+        const double span_ms = std::max(ms_between(start, s.last_frame), 1e-3);
+
+        first_frame_ms_sum += first_ms;
+        first_frame_ms_max = std::max(first_frame_ms_max, first_ms);
+        stream_fps_min = std::min(stream_fps_min, frames_per_stream * 1000.0 / span_ms);
+    }
+
+    const double total_ms = ms_between(start, end);
+
+    std::cout << format("%-12s %7u %10.1f %11.1f %14.1f %13.1f %13.1f\n") %
+                 (shared_lock ? "cdm-lock" : "per-instance") % stream_count % total_ms %
+                 (stream_count * frames_per_stream * 1000.0 / total_ms) % stream_fps_min %
+                 (first_frame_ms_sum / stream_count) % first_frame_ms_max;
+}
+
+} // namespace
+
+int
+main(int argc, char *argv[])
+{
+    if (argc > 1)
+        frames_per_stream = std::max(1, atoi(argv[1]));
+    if (argc > 3) {
+        frame_width = std::max(2, atoi(argv[2])) & ~1;
+        frame_height = std::max(2, atoi(argv[3])) & ~1;
+    }
+
+    std::cout << format("%1% frames per stream, %2%x%3%\n") % frames_per_stream % frame_width %
+                 frame_height;
+    std::cout << format("%-12s %7s %10s %11s %14s %13s %13s\n") % "locking" % "streams" %
+                 "total ms" % "total fps" % "slowest fps" % "first ms avg" % "first ms max";
+
+    for (bool shared_lock: {true, false}) {
+        for (uint32_t stream_count: {1, 2, 4, 8})
+            run(stream_count, shared_lock);
+    }
+
+    return 0;
+}
@@ -0,0 +1,405 @@
+/*
+ * Copyright © 2016  Rinat Ibragimov
+ *
+ * This file is part of gmp-widevine.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "audio.hh"
+#include <string.h>
+#include <math.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define AUDIO_X86 1
+#endif
+
+
+namespace audio {
+
+namespace {
+
+// Saturating conversion. Clamping is done in the same order as min/max instructions do it in
+// SIMD kernels below, so every path produces identical output, NaN included (it becomes 32767).
+inline int16_t
+f32_to_s16(float x)
+{
+    float v = x * 32768.0f;
+
+    v = (v < 32767.0f) ? v : 32767.0f;
+    v = (v > -32768.0f) ? v : -32768.0f;
+
+    return static_cast<int16_t>(lrintf(v));
+}
+
+inline int16_t
+s32_to_s16(int32_t s)
+{
+    return static_cast<int16_t>(s >> 16);
+}
+
+inline int16_t
+u8_to_s16(uint8_t s)
+{
+    return static_cast<int16_t>((int(s) - 128) * 256);
+}
+
+inline int16_t
+s16_to_s16(int16_t s)
+{
+    return s;
+}
+
+template <typename T, int16_t (*convert)(T)>
+void
+convert_interleaved_c(const uint8_t *src, size_t count, int16_t *dst)
+{
+    for (size_t k = 0; k < count; k ++) {
+        T s;
+        memcpy(&s, src + k * sizeof(T), sizeof(T));
+        dst[k] = convert(s);
+    }
+}
+
+// Interleaves frames [first, frames) of planar |src|.
+template <typename T, int16_t (*convert)(T)>
+void
+convert_planar_range_c(const uint8_t *src, uint32_t channels, uint32_t frames, int16_t *dst,
+                       uint32_t first)
+{
+    for (uint32_t ch = 0; ch < channels; ch ++) {
+        const uint8_t *plane = src + size_t(ch) * frames * sizeof(T);
+
+        for (uint32_t k = first; k < frames; k ++) {
+            T s;
+            memcpy(&s, plane + size_t(k) * sizeof(T), sizeof(T));
+            dst[size_t(k) * channels + ch] = convert(s);
+        }
+    }
+}
+
+template <typename T, int16_t (*convert)(T)>
+void
+convert_planar_c(const uint8_t *src, uint32_t channels, uint32_t frames, int16_t *dst)
+{
+    convert_planar_range_c<T, convert>(src, channels, frames, dst, 0);
+}
+
+typedef void (*convert_func)(const uint8_t *src, size_t count, int16_t *dst);
+typedef void (*interleave_func)(const uint8_t *src, uint32_t channels, uint32_t frames,
+                                int16_t *dst);
+
+#if AUDIO_X86
+
+__attribute__((target("sse2"))) inline __m128i
+f32x8_to_s16_sse2(const uint8_t *src)
+{
+    const __m128 scale = _mm_set1_ps(32768.0f);
+    const __m128 hi = _mm_set1_ps(32767.0f);
+    const __m128 lo = _mm_set1_ps(-32768.0f);
+
+    __m128 a = _mm_mul_ps(_mm_loadu_ps(reinterpret_cast<const float *>(src)), scale);
+    __m128 b = _mm_mul_ps(_mm_loadu_ps(reinterpret_cast<const float *>(src + 16)), scale);
+    a = _mm_max_ps(_mm_min_ps(a, hi), lo);
+    b = _mm_max_ps(_mm_min_ps(b, hi), lo);
+
+    return _mm_packs_epi32(_mm_cvtps_epi32(a), _mm_cvtps_epi32(b));
+}
+
+__attribute__((target("sse2"))) inline __m128i
+s16x8_load_sse2(const uint8_t *src)
+{
+    return _mm_loadu_si128(reinterpret_cast<const __m128i *>(src));
+}
+
+__attribute__((target("sse2"))) void
+f32_to_s16_sse2(const uint8_t *src, size_t count, int16_t *dst)
+{
+    size_t k = 0;
+    for (; k + 8 <= count; k += 8)
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + k), f32x8_to_s16_sse2(src + k * 4));
+
+    convert_interleaved_c<float, f32_to_s16>(src + k * 4, count - k, dst + k);
+}
+
+__attribute__((target("sse2"))) void
+s32_to_s16_sse2(const uint8_t *src, size_t count, int16_t *dst)
+{
+    size_t k = 0;
+    for (; k + 8 <= count; k += 8) {
+        __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + k * 4));
+        __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + k * 4 + 16));
+        __m128i r = _mm_packs_epi32(_mm_srai_epi32(a, 16), _mm_srai_epi32(b, 16));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + k), r);
+    }
+
+    convert_interleaved_c<int32_t, s32_to_s16>(src + k * 4, count - k, dst + k);
+}
+
+__attribute__((target("sse2"))) void
+u8_to_s16_sse2(const uint8_t *src, size_t count, int16_t *dst)
+{
+    const __m128i bias = _mm_set1_epi8(static_cast<char>(0x80));
+    const __m128i zero = _mm_setzero_si128();
+
+    size_t k = 0;
+    for (; k + 16 <= count; k += 16) {
+        // (s - 128) * 256 is just the biased byte placed in the upper half of a word
+        __m128i a = _mm_xor_si128(_mm_loadu_si128(reinterpret_cast<const __m128i *>(src + k)),
+                                  bias);
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + k), _mm_unpacklo_epi8(zero, a));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + k + 8), _mm_unpackhi_epi8(zero, a));
+    }
+
+    convert_interleaved_c<uint8_t, u8_to_s16>(src + k, count - k, dst + k);
+}
+
+// Writes 8 frames from |r|, where r[ch] holds 8 consecutive samples of channel |ch|.
+__attribute__((target("sse2"))) inline void
+store_8_frames_sse2(__m128i r[8], uint32_t channels, int16_t *dst)
+{
+    if (channels == 2) {
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(dst), _mm_unpacklo_epi16(r[0], r[1]));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + 8), _mm_unpackhi_epi16(r[0], r[1]));
+        return;
+    }
+
+    // 8x8 transpose of 16-bit elements; rows beyond |channels| are don't-care
+    __m128i a0 = _mm_unpacklo_epi16(r[0], r[1]);
+    __m128i a1 = _mm_unpackhi_epi16(r[0], r[1]);
+    __m128i a2 = _mm_unpacklo_epi16(r[2], r[3]);
+    __m128i a3 = _mm_unpackhi_epi16(r[2], r[3]);
+    __m128i a4 = _mm_unpacklo_epi16(r[4], r[5]);
+    __m128i a5 = _mm_unpackhi_epi16(r[4], r[5]);
+    __m128i a6 = _mm_unpacklo_epi16(r[6], r[7]);
+    __m128i a7 = _mm_unpackhi_epi16(r[6], r[7]);
+
+    __m128i b0 = _mm_unpacklo_epi32(a0, a2);
+    __m128i b1 = _mm_unpackhi_epi32(a0, a2);
+    __m128i b2 = _mm_unpacklo_epi32(a1, a3);
+    __m128i b3 = _mm_unpackhi_epi32(a1, a3);
+    __m128i b4 = _mm_unpacklo_epi32(a4, a6);
+    __m128i b5 = _mm_unpackhi_epi32(a4, a6);
+    __m128i b6 = _mm_unpacklo_epi32(a5, a7);
+    __m128i b7 = _mm_unpackhi_epi32(a5, a7);
+
+    __m128i f[8];
+    f[0] = _mm_unpacklo_epi64(b0, b4);
+    f[1] = _mm_unpackhi_epi64(b0, b4);
+    f[2] = _mm_unpacklo_epi64(b1, b5);
+    f[3] = _mm_unpackhi_epi64(b1, b5);
+    f[4] = _mm_unpacklo_epi64(b2, b6);
+    f[5] = _mm_unpackhi_epi64(b2, b6);
+    f[6] = _mm_unpacklo_epi64(b3, b7);
+    f[7] = _mm_unpackhi_epi64(b3, b7);
+
+    switch (channels) {
+    case 8:
+        for (int k = 0; k < 8; k ++)
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + k * 8), f[k]);
+        break;
+
+    case 6:
+        for (int k = 0; k < 8; k ++) {
+            _mm_storel_epi64(reinterpret_cast<__m128i *>(dst + k * 6), f[k]);
+            int32_t tail = _mm_cvtsi128_si32(_mm_srli_si128(f[k], 8));
+            memcpy(dst + k * 6 + 4, &tail, sizeof(tail));
+        }
+        break;
+
+    default:
+        for (int k = 0; k < 8; k ++) {
+            alignas(16) int16_t tmp[8];
+            _mm_store_si128(reinterpret_cast<__m128i *>(tmp), f[k]);
+            memcpy(dst + k * channels, tmp, channels * sizeof(int16_t));
+        }
+        break;
+    }
+}
+
+template <typename T, __m128i (*load8)(const uint8_t *), int16_t (*convert)(T)>
+__attribute__((target("sse2"))) void
+interleave_planar_sse2(const uint8_t *src, uint32_t channels, uint32_t frames, int16_t *dst)
+{
+    if (channels < 2 || channels > 8) {
+        convert_planar_c<T, convert>(src, channels, frames, dst);
+        return;
+    }
+
+    const size_t plane_size = size_t(frames) * sizeof(T);
+    __m128i r[8] = {};
+
+    uint32_t k = 0;
+    for (; k + 8 <= frames; k += 8) {
+        for (uint32_t ch = 0; ch < channels; ch ++)
+            r[ch] = load8(src + ch * plane_size + size_t(k) * sizeof(T));
+
+        store_8_frames_sse2(r, channels, dst + size_t(k) * channels);
+    }
+
+    convert_planar_range_c<T, convert>(src, channels, frames, dst, k);
+}
+
+__attribute__((target("avx2"))) void
+f32_to_s16_avx2(const uint8_t *src, size_t count, int16_t *dst)
+{
+    const __m256 scale = _mm256_set1_ps(32768.0f);
+    const __m256 hi = _mm256_set1_ps(32767.0f);
+    const __m256 lo = _mm256_set1_ps(-32768.0f);
+
+    size_t k = 0;
+    for (; k + 16 <= count; k += 16) {
+        __m256 a = _mm256_mul_ps(_mm256_loadu_ps(reinterpret_cast<const float *>(src + k * 4)),
+                                 scale);
+        __m256 b = _mm256_mul_ps(_mm256_loadu_ps(reinterpret_cast<const float *>(src + k * 4 + 32)),
+                                 scale);
+        a = _mm256_max_ps(_mm256_min_ps(a, hi), lo);
+        b = _mm256_max_ps(_mm256_min_ps(b, hi), lo);
+
+        // packs works within 128-bit lanes, restore sample order afterwards
+        __m256i r = _mm256_packs_epi32(_mm256_cvtps_epi32(a), _mm256_cvtps_epi32(b));
+        r = _mm256_permute4x64_epi64(r, 0xd8);
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + k), r);
+    }
+
+    f32_to_s16_sse2(src + k * 4, count - k, dst + k);
+}
+
+__attribute__((target("avx2"))) void
+s32_to_s16_avx2(const uint8_t *src, size_t count, int16_t *dst)
+{
+    size_t k = 0;
+    for (; k + 16 <= count; k += 16) {
+        __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + k * 4));
+        __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + k * 4 + 32));
+        __m256i r = _mm256_packs_epi32(_mm256_srai_epi32(a, 16), _mm256_srai_epi32(b, 16));
+        r = _mm256_permute4x64_epi64(r, 0xd8);
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + k), r);
+    }
+
+    s32_to_s16_sse2(src + k * 4, count - k, dst + k);
+}
+
+#endif // AUDIO_X86
+
+struct ConvertKernels {
+    convert_func    f32;
+    convert_func    s32;
+    convert_func    u8;
+    interleave_func planar_s16;
+    interleave_func planar_f32;
+};
+
+ConvertKernels
+select_convert_kernels()
+{
+#if AUDIO_X86
+    __builtin_cpu_init();
+
+    // planar kernels are bound by the transpose rather than by conversion, AVX2 doesn't help
+    // them much
+    if (__builtin_cpu_supports("avx2")) {
+        return ConvertKernels{f32_to_s16_avx2, s32_to_s16_avx2, u8_to_s16_sse2,
+                              interleave_planar_sse2<int16_t, s16x8_load_sse2, s16_to_s16>,
+                              interleave_planar_sse2<float, f32x8_to_s16_sse2, f32_to_s16>};
+    }
+
+    if (__builtin_cpu_supports("sse2")) {
+        return ConvertKernels{f32_to_s16_sse2, s32_to_s16_sse2, u8_to_s16_sse2,
+                              interleave_planar_sse2<int16_t, s16x8_load_sse2, s16_to_s16>,
+                              interleave_planar_sse2<float, f32x8_to_s16_sse2, f32_to_s16>};
+    }
+#endif // AUDIO_X86
+
+    return ConvertKernels{convert_interleaved_c<float, f32_to_s16>,
+                          convert_interleaved_c<int32_t, s32_to_s16>,
+                          convert_interleaved_c<uint8_t, u8_to_s16>,
+                          convert_planar_c<int16_t, s16_to_s16>,
+                          convert_planar_c<float, f32_to_s16>};
+}
+
+const ConvertKernels &
+convert_kernels()
+{
+    static const ConvertKernels kernels = select_convert_kernels();
+    return kernels;
+}
+
+} // anonymous namespace
+
+uint32_t
+bytes_per_sample(cdm::AudioFormat fmt)
+{
+    switch (fmt) {
+    case cdm::kAudioFormatU8:           return 1;
+    case cdm::kAudioFormatS16:          return 2;
+    case cdm::kAudioFormatS32:          return 4;
+    case cdm::kAudioFormatF32:          return 4;
+    case cdm::kAudioFormatPlanarS16:    return 2;
+    case cdm::kAudioFormatPlanarF32:    return 4;
+    default:                            return 0;
+    }
+}
+
+bool
+convert_to_s16(cdm::AudioFormat fmt, const uint8_t *src, uint32_t channels, uint32_t frames,
+               int16_t *dst)
+{
+    const ConvertKernels &kernels = convert_kernels();
+    const size_t count = size_t(channels) * frames;
+
+    switch (fmt) {
+    case cdm::kAudioFormatU8:
+        kernels.u8(src, count, dst);
+        return true;
+
+    case cdm::kAudioFormatS16:
+        memcpy(dst, src, count * sizeof(int16_t));
+        return true;
+
+    case cdm::kAudioFormatS32:
+        kernels.s32(src, count, dst);
+        return true;
+
+    case cdm::kAudioFormatF32:
+        kernels.f32(src, count, dst);
+        return true;
+
+    // a single plane is laid out exactly as interleaved samples are
+    case cdm::kAudioFormatPlanarS16:
+        if (channels == 1)
+            memcpy(dst, src, count * sizeof(int16_t));
+        else
+            kernels.planar_s16(src, channels, frames, dst);
+        return true;
+
+    case cdm::kAudioFormatPlanarF32:
+        if (channels == 1)
+            kernels.f32(src, count, dst);
+        else
+            kernels.planar_f32(src, channels, frames, dst);
+        return true;
+
+    default:
+        return false;
+    }
+}
+
+} // namespace audio
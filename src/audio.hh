@@ -0,0 +1,45 @@
+/*
+ * Copyright © 2016  Rinat Ibragimov
+ *
+ * This file is part of gmp-widevine.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <api/crcdm/content_decryption_module.h>
+
+
+namespace audio {
+
+// Size of a single sample of one channel in |fmt|, or zero for unknown formats.
+uint32_t
+bytes_per_sample(cdm::AudioFormat fmt);
+
+// Converts |frames| frames of |channels| channel audio from CDM's |fmt| (interleaved or planar)
+// to interleaved signed 16-bit PCM, as expected by GMPAudioSamples. |dst| must have room for
+// |frames| * |channels| samples. Returns false for unsupported formats.
+bool
+convert_to_s16(cdm::AudioFormat fmt, const uint8_t *src, uint32_t channels, uint32_t frames,
+               int16_t *dst);
+
+} // namespace audio
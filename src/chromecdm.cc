@@ -25,10 +25,23 @@
 #include "chromecdm.hh"
 #include "log.hh"
 #include <string>
+#include <string.h>
 #include <boost/format.hpp>
 #include <chrono>
 #include "firefoxcdm.hh"
+#include "keys.hh"
+#include "loader.hh"
+#include "storage.hh"
 #include <lib/RefCounted.h>
+#include <lib/gmp-task-utils.h>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <vector>
 
 
 using std::string;
@@ -37,7 +50,352 @@ using boost::format;
 
 namespace crcdm {
 
+class Host;
+
+// Main instance, the one with sessions and keys.
 cdm::ContentDecryptionModule *crcdm_instance = nullptr;
+uint32_t crcdm_instance_id = 0;
+
+// Serializes all calls into CDM, see Instance. Instances are only created, destroyed and looked
+// up while holding it.
+std::recursive_mutex cdm_mutex;
+
+// Instance ids tell callbacks meant for an instance that's gone; zero is never used.
+std::atomic<uint32_t> last_instance_id{0};
+
+struct LiveInstance {
+    cdm::ContentDecryptionModule   *cdm;
+    Host                           *host;
+};
+
+// Main instance and instances of decoders, by id. Guarded by cdm_mutex.
+std::map<uint32_t, LiveInstance> live_instances;
+
+// Pooled block offered by ScopedBufferLend on this thread, for an output of |size| bytes.
+struct LendContext {
+    uint8_t    *data = nullptr;
+    uint32_t    block_size = 0;
+    uint32_t    size = 0;
+    bool        active = false;
+    bool        used = false;
+};
+
+thread_local LendContext lend_context;
+
+// Recycles output buffers between decrypt calls. Blocks are kept in power-of-two sizes, so a
+// stream of similarly sized samples keeps hitting the same few blocks instead of malloc/free.
+class BufferPool {
+public:
+    static const uint32_t kMinBlockSize = 4096;
+    static const size_t kMaxBlocks = 8;
+    static const size_t kMaxBytes = 32 * 1024 * 1024;
+
+    static uint32_t
+    block_size(uint32_t capacity)
+    {
+        uint32_t sz = kMinBlockSize;
+        while (sz < capacity && sz < (1u << 31))
+            sz <<= 1;
+        return sz >= capacity ? sz : capacity;
+    }
+
+    static bool
+    is_block_size(uint32_t sz)
+    {
+        return sz >= kMinBlockSize && (sz & (sz - 1)) == 0;
+    }
+
+    uint8_t *
+    take(uint32_t sz)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            for (auto it = blocks_.begin(); it != blocks_.end(); ++it) {
+                if (it->size == sz) {
+                    uint8_t *data = it->data;
+                    pooled_bytes_ -= it->size;
+                    blocks_.erase(it);
+                    hits_ ++;
+                    return data;
+                }
+            }
+            misses_ ++;
+        }
+
+        return static_cast<uint8_t *>(malloc(sz));
+    }
+
+    void
+    give_back(uint8_t *data, uint32_t sz)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (blocks_.size() < kMaxBlocks && pooled_bytes_ + sz <= kMaxBytes) {
+                blocks_.push_back(Block{data, sz});
+                pooled_bytes_ += sz;
+                return;
+            }
+        }
+
+        free(data);
+    }
+
+    void
+    log_stats()
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        LOGS << format("crcdm::BufferPool: hits: %1%, misses: %2%, blocks kept: %3%\n") % hits_ %
+                misses_ % blocks_.size();
+    }
+
+private:
+    struct Block {
+        uint8_t    *data;
+        uint32_t    size;
+    };
+
+    std::mutex          mutex_;
+    std::vector<Block>  blocks_;
+    size_t              pooled_bytes_ = 0;
+    uint64_t            hits_ = 0;
+    uint64_t            misses_ = 0;
+};
+
+BufferPool buffer_pool;
+
+// Multiplexes CDM timers onto GMP ones. CDM timers are kept in a min-heap by due time, and
+// a GMP timer is only armed for the earliest of them; when it fires, every CDM timer that is
+// due by then runs. GMP timers can't be cancelled, so a timer that comes out earlier than the
+// armed one arms another GMP timer, and the stale one just finds nothing to do.
+class TimerQueue {
+public:
+    // CDM timers due this close to the armed GMP timer wait for it instead of arming a new one.
+    static const int64_t kSlackMs = 5;
+
+    // Delays between attempts to arm a GMP timer after settimer() failed.
+    static const int64_t kRetryMinMs = 10;
+    static const int64_t kRetryMaxMs = 1000;
+
+    void
+    add(int64_t delay_ms, void *context, uint32_t instance_id)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+
+        // heap storage is reused, so steady state doesn't allocate per timer
+        heap_.push_back(Timer{clock::now() + std::chrono::milliseconds(delay_ms), context,
+                              instance_id});
+        std::push_heap(heap_.begin(), heap_.end(), later_than);
+        timers_set_ ++;
+
+        arm_locked();
+    }
+
+    // Runs expired timers. Called by armed GMP timer.
+    void
+    fire(uint32_t arm_seq)
+    {
+        run_expired(false, arm_seq);
+    }
+
+    // Runs expired timers and tries to arm GMP timer again. Called on the main thread some
+    // time after settimer() failed.
+    void
+    retry()
+    {
+        run_expired(true, 0);
+    }
+
+    // Waits for the pending retry, if any. Called at plugin shutdown.
+    void
+    stop()
+    {
+        GMPThread *thread;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            thread = retry_thread_;
+            retry_thread_ = nullptr;
+            stopped_ = true;
+        }
+
+        if (thread)
+            thread->Join();
+    }
+
+    void
+    log_stats()
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        LOGS << format("crcdm::TimerQueue: timers set: %1%, fired: %2%, dropped: %3%, host timers "
+                "armed: %4% (%5% failed), lateness: average %6% ms, max %7% ms\n") %
+                timers_set_ % timers_fired_ % timers_dropped_ % host_timers_armed_ %
+                host_timer_failures_ % (timers_fired_ ? lateness_ms_sum_ / timers_fired_ : 0) %
+                max_lateness_ms_;
+    }
+
+private:
+    typedef std::chrono::steady_clock clock;
+
+    struct Timer {
+        clock::time_point   due;
+        void               *context;
+        uint32_t            instance_id;    // of CDM instance that set it
+    };
+
+    class FireTask final : public GMPTask {
+    public:
+        FireTask(TimerQueue *queue, uint32_t arm_seq)
+            : queue_(queue)
+            , arm_seq_(arm_seq)
+        {}
+
+        virtual void
+        Destroy() override { delete this; }
+
+        virtual void
+        Run() override { queue_->fire(arm_seq_); }
+
+    private:
+        TimerQueue *queue_;
+        uint32_t    arm_seq_;
+    };
+
+    static bool
+    later_than(const Timer &a, const Timer &b)
+    {
+        return a.due > b.due;
+    }
+
+    void
+    run_expired(bool is_retry, uint32_t arm_seq)
+    {
+        std::vector<Timer> expired;
+        clock::time_point now;
+
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (is_retry)
+                retry_pending_ = false;
+            else if (arm_seq == arm_seq_)
+                armed_ = false;
+
+            now = clock::now();
+            while (!heap_.empty() && heap_.front().due <= now) {
+                expired.push_back(heap_.front());
+                std::pop_heap(heap_.begin(), heap_.end(), later_than);
+                heap_.pop_back();
+            }
+
+            arm_locked();
+        }
+
+        // CDM may set new timers from TimerExpired(), so the queue is unlocked by now. Instance
+        // is looked up under CDM lock, which keeps it from being destroyed meanwhile.
+        for (const auto &t: expired) {
+            auto cdm = crcdm::get(t.instance_id);
+            if (cdm)
+                cdm->TimerExpired(t.context);
+
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (cdm) {
+                const int64_t late_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+                                            now - t.due).count();
+                lateness_ms_sum_ += late_ms;
+                max_lateness_ms_ = std::max(max_lateness_ms_, late_ms);
+                timers_fired_ ++;
+            } else {
+                timers_dropped_ ++;
+            }
+        }
+    }
+
+    void
+    arm_locked()
+    {
+        if (heap_.empty())
+            return;
+
+        const auto due = heap_.front().due;
+        if (armed_ && armed_due_ <= due + std::chrono::milliseconds(kSlackMs))
+            return;
+
+        const auto now = clock::now();
+        const int64_t delay_ms = due > now
+                                    ? std::chrono::duration_cast<std::chrono::milliseconds>(
+                                          due - now).count()
+                                    : 0;
+
+        auto task = new FireTask(this, arm_seq_ + 1);
+        if (GMP_FAILED(fxcdm::get_platform_api()->settimer(task, delay_ms))) {
+            LOGZ << "crcdm::TimerQueue: settimer failed\n";
+            host_timer_failures_ ++;
+            task->Destroy();
+            schedule_retry_locked();
+            return;
+        }
+
+        arm_seq_ ++;
+        armed_ = true;
+        armed_due_ = due;
+        host_timers_armed_ ++;
+        retry_delay_ms_ = kRetryMinMs;
+    }
+
+    // Nothing else may come to run queued timers, so try again later from a thread of our own,
+    // backing off while settimer() keeps failing.
+    void
+    schedule_retry_locked()
+    {
+        if (retry_pending_ || stopped_)
+            return;
+
+        if (!retry_thread_ &&
+            GMP_FAILED(fxcdm::get_platform_api()->createthread(&retry_thread_)))
+        {
+            LOGZ << "crcdm::TimerQueue: can't create thread, timers wait for next SetTimer\n";
+            retry_thread_ = nullptr;
+            return;
+        }
+
+        retry_pending_ = true;
+        retry_thread_->Post(WrapTask(this, &TimerQueue::retry_after, retry_delay_ms_));
+        retry_delay_ms_ = std::min(retry_delay_ms_ * 2, kRetryMaxMs);
+    }
+
+    // Runs on retry thread.
+    void
+    retry_after(int64_t delay_ms)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(delay_ms));
+
+        if (GMP_FAILED(fxcdm::get_platform_api()->runonmainthread(
+                WrapTask(this, &TimerQueue::retry))))
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            retry_pending_ = false;
+            schedule_retry_locked();
+        }
+    }
+
+    std::mutex          mutex_;
+    std::vector<Timer>  heap_;
+    bool                armed_ = false;
+    clock::time_point   armed_due_;
+    uint32_t            arm_seq_ = 0;       // identifies the latest armed GMP timer
+    GMPThread          *retry_thread_ = nullptr;
+    bool                retry_pending_ = false;
+    int64_t             retry_delay_ms_ = kRetryMinMs;
+    bool                stopped_ = false;
+
+    uint32_t            timers_set_ = 0;
+    uint32_t            timers_fired_ = 0;
+    uint32_t            timers_dropped_ = 0;    // set by a CDM instance that's gone
+    uint32_t            host_timers_armed_ = 0;
+    uint32_t            host_timer_failures_ = 0;
+    int64_t             lateness_ms_sum_ = 0;
+    int64_t             max_lateness_ms_ = 0;
+};
+
+TimerQueue timer_queue;
 
 class BufferImpl final : public cdm::Buffer {
 public:
@@ -45,7 +403,20 @@ public:
     {
         LOGF << boost::format("cdm::BufferImpl::BufferImpl this=%1%, capacity=%2%\n") % this %
                 capacity;
-        SetSize(capacity);
+        const uint32_t block_size = BufferPool::block_size(capacity);
+        data_ = buffer_pool.take(block_size);
+        capacity_ = data_ ? block_size : 0;
+        sz_ = data_ ? capacity : 0;
+    }
+
+    // Takes over a block already taken from |buffer_pool|.
+    BufferImpl(uint8_t *block, uint32_t block_size, uint32_t size)
+        : data_(block)
+        , sz_(size)
+        , capacity_(block_size)
+    {
+        LOGF << boost::format("cdm::BufferImpl::BufferImpl this=%1%, block=%2%, "
+                "block_size=%3%\n") % this % static_cast<const void *>(block) % block_size;
     }
 
     ~BufferImpl()
@@ -56,7 +427,13 @@ public:
     virtual void
     Destroy() override {
         LOGF << "cdm::BufferImpl::Destroy (void)\n";
-        free(data_); data_ = nullptr; sz_ = 0;
+        if (data_) {
+            if (BufferPool::is_block_size(capacity_))
+                buffer_pool.give_back(data_, capacity_);
+            else
+                free(data_);
+        }
+        data_ = nullptr; sz_ = 0; capacity_ = 0;
         delete this;
     }
 
@@ -64,7 +441,7 @@ public:
     Capacity() const override
     {
         LOGF << "cdm::BufferImpl::Capacity (void)\n";
-        return sz_;
+        return capacity_;
     }
 
     virtual uint8_t *
@@ -78,7 +455,16 @@ public:
     SetSize(uint32_t size) override
     {
         LOGF << boost::format("cdm::BufferImpl::SetSize size=%1%\n") % size;
-        data_ = static_cast<uint8_t *>(realloc(static_cast<void *>(data_), size));
+
+        // CDM usually shrinks buffer to the actual payload size; keep the allocation then, and
+        // only grow it when needed
+        if (size > capacity_) {
+            auto new_data = static_cast<uint8_t *>(realloc(static_cast<void *>(data_), size));
+            if (!new_data)
+                return;
+            data_ = new_data;
+            capacity_ = size;
+        }
         sz_ = size;
     }
 
@@ -92,108 +478,105 @@ public:
 private:
     uint8_t *data_ = nullptr;
     uint32_t sz_ = 0;
+    uint32_t capacity_ = 0;
 };
 
-class GMPRecordClientImpl final : public GMPRecordClient {
-private:
-    cdm::FileIOClient::Status
-    to_FileIOClient_Status(GMPErr aStatus)
-    {
-        switch (aStatus) {
-        case GMPNoErr:       return cdm::FileIOClient::kSuccess;
-        case GMPRecordInUse: return cdm::FileIOClient::kInUse;
-        default:             return cdm::FileIOClient::kError;
-        }
-    }
-
+// Keeps the last server certificate accepted by CDM in GMP storage, which is separate for each
+// origin. CDM can't use file names starting with an underscore, so there is no clash with its
+// own files.
+class ServerCertificateRecord final : public cdm::FileIOClient {
 public:
-    virtual void
-    OpenComplete(GMPErr aStatus) override
+    // Reads stored certificate and passes it to CDM.
+    static void
+    load()
     {
-        LOGF << format("fxcdm::GMPRecordClientImpl::OpenComplete aStatus=%1%\n") % aStatus;
-        file_io_client_->OnOpenComplete(to_FileIOClient_Status(aStatus));
+        (new ServerCertificateRecord(std::vector<uint8_t>(), false))->open();
     }
 
-    virtual void
-    ReadComplete(GMPErr aStatus, const uint8_t *aData, uint32_t aDataSize) override
+    static void
+    store(const std::vector<uint8_t> &cert)
     {
-        LOGF << format("fxcdm::GMPRecordClientImpl::ReadComplete aStatus=%1%, aData=%2%, "
-                "aDataSize=%3%\n") % aStatus % static_cast<const void *>(aData) % aDataSize;
-        file_io_client_->OnReadComplete(to_FileIOClient_Status(aStatus), aData, aDataSize);
+        (new ServerCertificateRecord(cert, true))->open();
     }
 
     virtual void
-    WriteComplete(GMPErr aStatus) override
+    OnOpenComplete(Status status) override
     {
-        LOGF << format("fxcdm::GMPRecordClientImpl::WriteComplete aStatus=%1%\n") % aStatus;
-        file_io_client_->OnWriteComplete(to_FileIOClient_Status(aStatus));
-    }
+        LOGF << format("crcdm::ServerCertificateRecord::OnOpenComplete status=%1%\n") % status;
 
-    void
-    set_file_io_client(cdm::FileIOClient *file_io_client)
-    {
-        file_io_client_ = file_io_client;
-    }
+        if (status != kSuccess) {
+            finish();
+            return;
+        }
 
-private:
-    cdm::FileIOClient   *file_io_client_ = nullptr;
-};
+        if (storing_)
+            file_io_->Write(cert_.data(), cert_.size());
+        else
+            file_io_->Read();
+    }
 
-class FileIO final : public cdm::FileIO, public RefCounted {
-public:
     virtual void
-    Open(const char *file_name, uint32_t file_name_size) override
-    {
-        LOGF << format("crcdm::FileIO::Open file_name=%1%, file_name_size=%2%\n") %
-                string(file_name, file_name_size) % file_name_size;
-
-        fxcdm::get_platform_api()->createrecord(file_name, file_name_size, &rec_, &rec_client_);
-        rec_client_.set_file_io_client(file_io_client_);
-        rec_->Open();
-    }
+    OnReadComplete(Status status, const uint8_t *data, uint32_t data_size) override;
 
     virtual void
-    Read() override
+    OnWriteComplete(Status status) override
     {
-        LOGF << "crcdm::FileIO::Read (void)\n";
-        rec_->Read();
+        LOGF << format("crcdm::ServerCertificateRecord::OnWriteComplete status=%1%\n") % status;
+        finish();
     }
 
-    virtual void
-    Write(const uint8_t *data, uint32_t data_size) override
+private:
+    ServerCertificateRecord(const std::vector<uint8_t> &cert, bool storing)
+        : cert_(cert)
+        , storing_(storing)
     {
-        LOGF << format("crcdm::FileIO::Write data=%1%, data_size=%2%\n") %
-                static_cast<const void *>(data) % data_size;
-        rec_->Write(data, data_size);
     }
 
-    virtual void
-    Close() override
+    void
+    open()
     {
-        LOGF << "crcdm::FileIO::Close (void)\n";
-        rec_->Close();
-        Release();
+        file_io_ = storage::create_file_io(this);
+        file_io_->Open(kRecordName, sizeof(kRecordName) - 1);
     }
 
-    FileIO(cdm::FileIOClient *file_io_client)
-        : file_io_client_(file_io_client)
+    void
+    finish()
     {
-        AddRef();
+        file_io_->Close();
+        delete this;
     }
 
-private:
-    cdm::FileIOClient   *file_io_client_;
-    GMPRecord           *rec_;
-    GMPRecordClientImpl  rec_client_;
+    static constexpr const char kRecordName[] = "_server_certificate";
+
+    std::vector<uint8_t>    cert_;
+    bool                    storing_;
+    cdm::FileIO            *file_io_ = nullptr;
 };
 
+constexpr const char ServerCertificateRecord::kRecordName[];
 
 class Host final: public cdm::ContentDecryptionModule::Host {
 public:
+    explicit Host(uint32_t instance_id)
+        : instance_id_(instance_id)
+    {}
+
+    uint32_t
+    instance_id() const { return instance_id_; }
+
     virtual cdm::Buffer *
     Allocate(uint32_t capacity) override
     {
         LOGF << format("crcdm::Host::Allocate capacity=%1%\n") % capacity;
+
+        // only the output buffer of a sample has exactly the size of its input; scratch
+        // allocations CDM makes along the way come from the pool as usual
+        LendContext &lend = lend_context;
+        if (lend.active && !lend.used && capacity == lend.size) {
+            lend.used = true;
+            return new BufferImpl(lend.data, lend.block_size, capacity);
+        }
+
         return new BufferImpl(capacity);
     }
 
@@ -202,23 +585,7 @@ public:
     {
         LOGF << format("crcdm::Host::SetTimer delay_ms=%1%, context=%2%\n") % delay_ms % context;
 
-        class Task final : public GMPTask {
-        public:
-            virtual void
-            Destroy() { delete this; }
-
-            virtual void
-            Run() { crcdm::get()->TimerExpired(context_); }
-
-            Task(void *context)
-                : context_(context)
-            {}
-        private:
-            void *context_;
-        };
-
-        // TODO: handle errors
-        fxcdm::get_platform_api()->settimer(new Task(context), delay_ms);
+        timer_queue.add(delay_ms, context, instance_id_);
     }
 
     virtual cdm::Time
@@ -241,8 +608,21 @@ public:
         LOGF << format("crcdm::Host::OnResolveNewSessionPromise promise_id=%1%, session_id=%2%\n")
                 % promise_id % string(session_id, session_id_size);
 
-        fxcdm::host()->SetSessionId(create_session_token_, session_id, session_id_size);
+        if (load_session_promises_.erase(promise_id) > 0) {
+            // CDM resolves with an empty session id when there is no stored session to load
+            fxcdm::host()->ResolveLoadSessionPromise(promise_id, session_id_size > 0);
+            return;
+        }
+
+        auto it = create_session_tokens_.find(promise_id);
+        if (it == create_session_tokens_.end()) {
+            LOGZ << format("crcdm::Host: no session token for promise %1%\n") % promise_id;
+            return;
+        }
+
+        fxcdm::host()->SetSessionId(it->second, session_id, session_id_size);
         fxcdm::host()->ResolveLoadSessionPromise(promise_id, true);
+        create_session_tokens_.erase(it);
     }
 
     virtual void
@@ -250,6 +630,17 @@ public:
     {
         LOGF << format("crcdm::Host::OnResolvePromise promise_id=%1%\n") % promise_id;
 
+        if (internal_promises_.erase(promise_id) > 0) {
+            LOGF << "   stored server certificate accepted\n";
+            return;
+        }
+
+        auto it = certificate_promises_.find(promise_id);
+        if (it != certificate_promises_.end()) {
+            store_server_certificate(it->second);
+            certificate_promises_.erase(it);
+        }
+
         fxcdm::host()->ResolvePromise(promise_id);
     }
 
@@ -261,6 +652,15 @@ public:
                 "error_message=%4%, error_message_size=%5%\n") % promise_id % error % system_code %
                 string(error_message, error_message_size) % error_message_size;
 
+        load_session_promises_.erase(promise_id);
+        certificate_promises_.erase(promise_id);
+        create_session_tokens_.erase(promise_id);
+
+        if (internal_promises_.erase(promise_id) > 0) {
+            LOGZ << "crcdm::Host: CDM rejected stored server certificate\n";
+            return;
+        }
+
         auto to_GMPDOMException = [](cdm::Error error) {
             switch (error) {
             case cdm::kNotSupportedError:  return kGMPNotSupportedError;
@@ -296,6 +696,9 @@ public:
             };
         };
 
+        if (message_type == cdm::kLicenseRequest)
+            storage::startup_done();
+
         fxcdm::host()->SessionMessage(session_id, session_id_size,
                                       convert_to_GMPSessionMessageType(message_type),
                                       reinterpret_cast<const uint8_t *>(message), message_size);
@@ -327,11 +730,31 @@ public:
         for (uint32_t k = 0; k < keys_info_count; k ++) {
             LOGF << format("   key = (%1%) %2%\n") % keys_info[k].status %
                     fxcdm::to_hex_string(keys_info[k].key_id, keys_info[k].key_id_size);
+        }
+
+        // CDM re-reports whole key set on every license renewal; only actual status transitions
+        // are worth an IPC message
+        auto changes = keys::update(string(session_id, session_id_size), keys_info,
+                                    keys_info_count);
 
+        fxcdm::KeyStatuses statuses;
+        for (uint32_t k: changes.changed) {
+            const auto status = to_GMPMediaKeyStatus(keys_info[k].status);
             fxcdm::host()->KeyStatusChanged(session_id, session_id_size, keys_info[k].key_id,
-                                            keys_info[k].key_id_size,
-                                            to_GMPMediaKeyStatus(keys_info[k].status));
+                                            keys_info[k].key_id_size, status);
+            statuses.emplace_back(keys::KeyId(keys_info[k].key_id,
+                                              keys_info[k].key_id + keys_info[k].key_id_size),
+                                  status);
         }
+
+        key_statuses_forwarded_ += changes.changed.size();
+        key_statuses_suppressed_ += keys_info_count - changes.changed.size();
+
+        if (!statuses.empty())
+            fxcdm::session_keys_changed(string(session_id, session_id_size), statuses);
+
+        if (!changes.became_usable.empty())
+            fxcdm::keys_became_usable(changes.became_usable);
     }
 
     virtual void
@@ -343,8 +766,9 @@ public:
                 session_id_size % new_expiry_time;
 
         if (new_expiry_time != 0) {
-            fxcdm::host()->ExpirationChange(session_id, session_id_size,
-                                            static_cast<int64_t>(new_expiry_time * 1e3));
+            const int64_t expiry_ms = static_cast<int64_t>(new_expiry_time * 1e3);
+            fxcdm::host()->ExpirationChange(session_id, session_id_size, expiry_ms);
+            fxcdm::session_expiration_changed(string(session_id, session_id_size), expiry_ms);
         }
     }
 
@@ -354,7 +778,9 @@ public:
         LOGF << format("crcdm::Host::OnSessionClosed session_id=%1%, session_id_size=%2%\n") %
                 string(session_id, session_id_size) % session_id_size;
 
+        keys::session_closed(string(session_id, session_id_size));
         fxcdm::host()->SessionClosed(session_id, session_id_size);
+        fxcdm::session_closed(string(session_id, session_id_size));
     }
 
     virtual void
@@ -390,73 +816,486 @@ public:
     virtual void
     OnDeferredInitializationDone(cdm::StreamType stream_type, cdm::Status decoder_status) override
     {
-        LOGZ << "crcdm::Host::OnDeferredInitializationDone\n";
+        LOGF << format("crcdm::Host::OnDeferredInitializationDone stream_type=%1%, "
+                "decoder_status=%2%\n") % stream_type % decoder_status;
+
+        fxcdm::deferred_initialization_done(instance_id_, stream_type, decoder_status);
     }
 
     virtual cdm::FileIO *
     CreateFileIO(cdm::FileIOClient *client) override
     {
         LOGF << format("crcdm::Host::CreateFileIO client=%1%\n") % client;
-        return new FileIO(client);
+        return storage::create_file_io(client);
     }
 
     void
-    set_create_session_token(uint32_t create_session_token)
+    set_create_session_token(uint32_t promise_id, uint32_t create_session_token)
     {
-        create_session_token_ = create_session_token;
+        create_session_tokens_[promise_id] = create_session_token;
+    }
+
+    void
+    add_load_session_promise(uint32_t promise_id)
+    {
+        load_session_promises_.insert(promise_id);
+    }
+
+    void
+    set_server_certificate(uint32_t promise_id, const uint8_t *cert, uint32_t cert_size)
+    {
+        // page's own certificate wins over the stored one, even if that one is still loading
+        certificate_set_by_page_ = true;
+        if (!crcdm_instance)
+            return;
+
+        certificate_promises_[promise_id].assign(cert, cert + cert_size);
+        crcdm::get()->SetServerCertificate(promise_id, cert, cert_size);
+    }
+
+    void
+    apply_stored_server_certificate(const std::vector<uint8_t> &cert)
+    {
+        stored_certificate_ = cert;
+
+        if (certificate_set_by_page_ || cert.empty() || !crcdm_instance)
+            return;
+
+        // promise ids Firefox uses count up from zero; take ours from the other end
+        const uint32_t promise_id = next_internal_promise_id_ --;
+        internal_promises_.insert(promise_id);
+        crcdm::get()->SetServerCertificate(promise_id, cert.data(), cert.size());
+        stored_certificates_applied_ ++;
+    }
+
+    void
+    store_server_certificate(const std::vector<uint8_t> &cert)
+    {
+        if (cert == stored_certificate_)
+            return;
+
+        stored_certificate_ = cert;
+        ServerCertificateRecord::store(cert);
+    }
+
+    void
+    log_stats()
+    {
+        LOGS << format("crcdm::Host: key statuses forwarded: %1%, suppressed as unchanged: %2%\n") %
+                key_statuses_forwarded_ % key_statuses_suppressed_;
+        LOGS << format("crcdm::Host: stored server certificate applied: %1% times\n") %
+                stored_certificates_applied_;
+        buffer_pool.log_stats();
+        timer_queue.log_stats();
+        storage::log_stats();
     }
 
 private:
-    uint32_t create_session_token_ = 0;
+    const uint32_t instance_id_;
+
+    // Promise callbacks come on main thread, the same one Module calls come on, so none of
+    // these need locking. Several sessions can be in creation at once. Instances of decoders
+    // have no sessions, and never use these.
+    std::map<uint32_t, uint32_t> create_session_tokens_;     // promise id -> token
+    std::set<uint32_t> load_session_promises_;
+    std::map<uint32_t, std::vector<uint8_t>> certificate_promises_;
+    std::set<uint32_t> internal_promises_;      // issued by the plugin itself, not by Firefox
+    uint32_t next_internal_promise_id_ = UINT32_MAX;
+    bool certificate_set_by_page_ = false;
+    std::vector<uint8_t> stored_certificate_;
+    uint32_t stored_certificates_applied_ = 0;
+    uint32_t key_statuses_forwarded_ = 0;
+    uint32_t key_statuses_suppressed_ = 0;
 };
 
 Host *crcdm_host_instance = nullptr;
 
+void
+ServerCertificateRecord::OnReadComplete(Status status, const uint8_t *data, uint32_t data_size)
+{
+    LOGF << format("crcdm::ServerCertificateRecord::OnReadComplete status=%1%, data_size=%2%\n") %
+            status % data_size;
+
+    if (status == kSuccess && crcdm_host_instance)
+        crcdm_host_instance->apply_stored_server_certificate(
+                                std::vector<uint8_t>(data, data + data_size));
+    finish();
+}
+
 void *
 get_cdm_host_func(int host_interface_version, void *user_data)
 {
     LOGF << format("crcdm::get_cdm_host_func host_interface_version=%d, user_data=%p\n") %
             host_interface_version % user_data;
 
-    crcdm_host_instance = new crcdm::Host(); // XXX: relying on the fact the function is called
-                                             //      once, which could be wrong
+    // each instance is created with a Host of its own, passed here by new_instance()
+    return user_data;
+}
+
+namespace {
+
+// CDM module initialization runs on a background thread started at GMPInit, so it overlaps
+// with whatever Firefox does before creating the decryptor.
+std::mutex              module_init_mutex;
+std::condition_variable module_init_cv;
+bool                    module_init_started = false;
+bool                    module_init_done = false;
+GMPThread              *module_init_thread = nullptr;
+
+// CDM instance created ahead of time, which no Module has used yet
+bool                    instance_is_spare = false;
+
+void
+initialize_module_task()
+{
+    // ahead of the first decrypt or decode, which would otherwise fault CDM code in
+    loader::prefetch();
+
+    auto start = std::chrono::steady_clock::now();
+    loader::initialize_cdm_module();
+
+    LOGS << format("crcdm: module initialization took %1% us\n") %
+            std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::steady_clock::now() - start).count();
+
+    {
+        std::lock_guard<std::mutex> lock(module_init_mutex);
+        module_init_done = true;
+    }
+    module_init_cv.notify_all();
+
+    fxcdm::get_platform_api()->runonmainthread(WrapTaskNM(&prepare_spare_instance));
+}
+
+void
+wait_for_module()
+{
+    {
+        std::lock_guard<std::mutex> lock(module_init_mutex);
+        if (!module_init_started) {
+            // no background thread, do it here
+            module_init_started = true;
+            if (loader::load())
+                loader::initialize_cdm_module();
+            module_init_done = true;
+            return;
+        }
+    }
+
+    std::unique_lock<std::mutex> lock(module_init_mutex);
+    module_init_cv.wait(lock, [] { return module_init_done; });
+}
+
+// Creates and registers a CDM instance that calls back into |host|. Returns null on failure.
+// Called holding cdm_mutex.
+cdm::ContentDecryptionModule *
+new_instance(Host *host)
+{
+    const string key_system {"com.widevine.alpha"};
+    void *ptr = loader::create_cdm_instance(cdm::ContentDecryptionModule::kVersion,
+                                            key_system.c_str(), key_system.length(),
+                                            get_cdm_host_func, host);
+
+    LOGF << "  --> " << ptr << "\n";
+    auto instance = static_cast<cdm::ContentDecryptionModule *>(ptr);
+    if (!instance) {
+        LOGZ << "crcdm: CreateCdmInstance failed\n";
+        return nullptr;
+    }
+
+    live_instances[host->instance_id()] = LiveInstance{instance, host};
+    instance->Initialize(true, true);     // TODO: allow_distinctive_identifier?
+
+    return instance;
+}
+
+// Unregisters and destroys instance |instance_id|, and returns its Host, which is the caller's
+// to delete. Called holding cdm_mutex.
+Host *
+destroy_instance_locked(uint32_t instance_id)
+{
+    auto it = live_instances.find(instance_id);
+    if (it == live_instances.end())
+        return nullptr;
+
+    LiveInstance entry = it->second;
+    live_instances.erase(it);
+    entry.cdm->Destroy();
+
+    return entry.host;
+}
+
+void
+create_instance()
+{
+    if (crcdm_instance) {
+        // decoders may still use it; replacing it would leak it and pull it from under them
+        LOGZ << "crcdm: CDM instance exists already, not creating another one\n";
+        return;
+    }
+
+    if (!loader::load())
+        return;
+
+    // record list is needed by the time CDM starts looking for its files
+    storage::init();
+
+    {
+        std::lock_guard<std::recursive_mutex> lock(cdm_mutex);
+        crcdm_instance_id = ++ last_instance_id;
+        crcdm_host_instance = new Host(crcdm_instance_id);
+        crcdm_instance = new_instance(crcdm_host_instance);
+
+        if (!crcdm_instance) {
+            // nothing is left to call back into it
+            delete crcdm_host_instance;
+            crcdm_host_instance = nullptr;
+            crcdm_instance_id = 0;
+            return;
+        }
+    }
+
+    // saves the certificate request round trip with license server, if page uses privacy mode
+    ServerCertificateRecord::load();
+}
+
+} // anonymous namespace
+
+void
+prepare_spare_instance()
+{
+    LOGF << "crcdm::prepare_spare_instance\n";
+
+    if (crcdm_instance)
+        return;
+
+    {
+        std::lock_guard<std::mutex> lock(module_init_mutex);
+        if (!module_init_done)
+            return;
+    }
 
-    return static_cast<void *>(crcdm_host_instance);
+    create_instance();
+    instance_is_spare = (crcdm_instance != nullptr);
 }
 
 void
+prewarm()
+{
+    LOGF << "crcdm::prewarm\n";
+
+    {
+        std::lock_guard<std::mutex> lock(module_init_mutex);
+        if (module_init_started)
+            return;
+
+        // dlopen() has best chances this early
+        if (!loader::load())
+            return;
+
+        if (GMP_FAILED(fxcdm::get_platform_api()->createthread(&module_init_thread))) {
+            LOGZ << "crcdm::prewarm: can't create thread, CDM will be initialized on demand\n";
+            module_init_thread = nullptr;
+            return;
+        }
+
+        module_init_started = true;
+    }
+
+    module_init_thread->Post(WrapTaskNM(&initialize_module_task));
+}
+
+bool
 Initialize()
 {
     LOGF << "crcdm::Initialize\n";
-    INITIALIZE_CDM_MODULE();
 
-    const string key_system {"com.widevine.alpha"};
+    auto start = std::chrono::steady_clock::now();
+    const bool warm = instance_is_spare && crcdm_instance;
 
-    void *ptr = CreateCdmInstance(cdm::ContentDecryptionModule::kVersion, key_system.c_str(),
-                                  key_system.length(), get_cdm_host_func, nullptr);
+    if (warm) {
+        instance_is_spare = false;
+    } else {
+        wait_for_module();
 
-    LOGF << "  --> " << ptr << "\n";
-    crcdm_instance = static_cast<cdm::ContentDecryptionModule *>(ptr);
-    crcdm_instance->Initialize(true, true);     // TODO: allow_distinctive_identifier?
+        if (crcdm_instance) {
+            // previous instance is still used by decoders; the new Module shares it with them
+            LOGZ << "crcdm::Initialize: previous CDM instance is still alive, reusing it\n";
+        } else {
+            create_instance();
+        }
+    }
+
+    LOGS << format("crcdm: %1% CDM initialization took %2% us\n") % (warm ? "warm" : "cold") %
+            std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::steady_clock::now() - start).count();
+
+    return crcdm_instance != nullptr;
 }
 
 void
 Deinitialize()
 {
     LOGF << "crcdm::Deinitialize\n";
-    DeinitializeCdmModule();
+
+    if (!crcdm_instance)
+        return;
+
+    if (crcdm_host_instance)
+        crcdm_host_instance->log_stats();
+
+    {
+        std::lock_guard<std::recursive_mutex> lock(cdm_mutex);
+        destroy_instance_locked(crcdm_instance_id);
+        crcdm_instance = nullptr;
+        crcdm_instance_id = 0;
+    }
+
+    delete crcdm_host_instance;
+    crcdm_host_instance = nullptr;
+
+    keys::reset();
+
+    // next Module in this process gets an instance that's ready to go; it's never seen any
+    // session, so nothing leaks from the previous page
+    fxcdm::get_platform_api()->runonmainthread(WrapTaskNM(&prepare_spare_instance));
 }
 
-cdm::ContentDecryptionModule *
+void
+Shutdown()
+{
+    LOGF << "crcdm::Shutdown\n";
+
+    timer_queue.stop();
+
+    if (module_init_thread) {
+        module_init_thread->Join();
+        module_init_thread = nullptr;
+    }
+
+    {
+        std::lock_guard<std::recursive_mutex> lock(cdm_mutex);
+        while (!live_instances.empty()) {
+            Host *host = destroy_instance_locked(live_instances.begin()->first);
+            if (host != crcdm_host_instance)
+                delete host;
+        }
+        crcdm_instance = nullptr;
+        crcdm_instance_id = 0;
+    }
+
+    bool module_initialized;
+    {
+        std::lock_guard<std::mutex> lock(module_init_mutex);
+        module_initialized = module_init_done;
+    }
+
+    if (module_initialized && loader::load())
+        loader::deinitialize_cdm_module();
+}
+
+Instance
 get()
 {
-    return crcdm_instance;
+    std::unique_lock<std::recursive_mutex> lock(cdm_mutex);
+    return Instance(crcdm_instance, std::move(lock));
+}
+
+Instance
+get(uint32_t instance_id)
+{
+    std::unique_lock<std::recursive_mutex> lock(cdm_mutex);
+    auto it = live_instances.find(instance_id);
+    return Instance(it != live_instances.end() ? it->second.cdm : nullptr, std::move(lock));
+}
+
+uint32_t
+instance_id()
+{
+    std::lock_guard<std::recursive_mutex> lock(cdm_mutex);
+    return crcdm_instance_id;
+}
+
+uint32_t
+create_decoder_instance()
+{
+    LOGF << "crcdm::create_decoder_instance\n";
+
+    wait_for_module();
+    if (!loader::load())
+        return 0;
+
+    std::lock_guard<std::recursive_mutex> lock(cdm_mutex);
+    const uint32_t id = ++ last_instance_id;
+    Host *host = new Host(id);
+
+    if (!new_instance(host)) {
+        delete host;
+        return 0;
+    }
+
+    return id;
+}
+
+void
+destroy_decoder_instance(uint32_t instance_id)
+{
+    LOGF << format("crcdm::destroy_decoder_instance instance_id=%1%\n") % instance_id;
+
+    std::lock_guard<std::recursive_mutex> lock(cdm_mutex);
+
+    // main instance goes only with Deinitialize()
+    if (instance_id == crcdm_instance_id)
+        return;
+
+    delete destroy_instance_locked(instance_id);
+}
+
+ScopedLock::ScopedLock()
+    : lock_(cdm_mutex)
+{
+}
+
+// Wrappers below do nothing without an instance; callers reject their promises themselves.
+
+void
+set_create_session_token(uint32_t promise_id, uint32_t create_session_token)
+{
+    if (crcdm_host_instance)
+        crcdm_host_instance->set_create_session_token(promise_id, create_session_token);
+}
+
+void
+add_load_session_promise(uint32_t promise_id)
+{
+    if (crcdm_host_instance)
+        crcdm_host_instance->add_load_session_promise(promise_id);
 }
 
 void
-set_create_session_token(uint32_t create_session_token)
+set_server_certificate(uint32_t promise_id, const uint8_t *cert, uint32_t cert_size)
+{
+    if (crcdm_host_instance)
+        crcdm_host_instance->set_server_certificate(promise_id, cert, cert_size);
+}
+
+ScopedBufferLend::ScopedBufferLend(uint32_t size)
 {
-    crcdm_host_instance->set_create_session_token(create_session_token);
+    LendContext &lend = lend_context;
+    lend.block_size = BufferPool::block_size(size);
+    lend.data = buffer_pool.take(lend.block_size);
+    lend.size = size;
+    lend.active = (lend.data != nullptr);
+    lend.used = false;
+}
+
+ScopedBufferLend::~ScopedBufferLend()
+{
+    LendContext &lend = lend_context;
+    if (lend.active && !lend.used)
+        buffer_pool.give_back(lend.data, lend.block_size);
+
+    lend_context = LendContext();
 }
 
 } // namespace crcdm
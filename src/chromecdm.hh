@@ -28,22 +28,126 @@
 #include <api/crcdm/content_decryption_module.h>
 #include <api/gmp/gmp-decryption.h>
 #include <boost/format.hpp>
+#include <mutex>
 #include "log.hh"
 
 
 namespace crcdm {
 
+// Starts CDM module initialization on a background thread. Called from GMPInit.
 void
+prewarm();
+
+// Creates CDM instance ahead of time, on main thread, so the next Initialize() has it ready.
+// Does nothing if module is not initialized yet, or an instance exists already.
+void
+prepare_spare_instance();
+
+// Makes CDM instance for a Module. Uses spare instance if there is one. Returns false if there
+// is no instance, as CDM library couldn't be loaded or refused to create one.
+bool
 Initialize();
 
+// Destroys CDM instance and prepares a fresh one for the next Module. Must not be called while
+// decoders still use the instance.
 void
 Deinitialize();
 
-cdm::ContentDecryptionModule *
+// Releases everything at process shutdown.
+void
+Shutdown();
+
+// CDM interface is single-threaded, while decrypt thread, decoder workers and main thread all
+// call it. Every call goes through an Instance, which holds CDM lock while it exists, so
+// crcdm::get()->Call() is serialized with all other calls. The lock is recursive: CDM calls back
+// into host, which may call CDM again.
+class Instance final
+{
+public:
+    Instance(cdm::ContentDecryptionModule *cdm, std::unique_lock<std::recursive_mutex> &&lock)
+        : lock_(std::move(lock))
+        , cdm_(cdm)
+    {}
+
+    Instance(Instance &&) = default;
+
+    cdm::ContentDecryptionModule *
+    operator->() const { return cdm_; }
+
+    explicit operator bool() const { return cdm_ != nullptr; }
+
+private:
+    std::unique_lock<std::recursive_mutex>  lock_;
+    cdm::ContentDecryptionModule           *cdm_;
+};
+
+// Main CDM instance, the one with sessions and keys; tests false if there is none.
+Instance
 get();
 
+// CDM instance |instance_id|; tests false if it's gone.
+Instance
+get(uint32_t instance_id);
+
+// Id of the main instance, zero if there is none. Ids are never reused.
+uint32_t
+instance_id();
+
+// A CDM instance has a single decoder of each kind. Decoders beyond the first get an instance of
+// their own: it has no sessions, so their samples are decrypted by the main instance and reach
+// it in the clear. All instances share the CDM lock. Returns the instance id, zero on failure.
+// Main thread only.
+uint32_t
+create_decoder_instance();
+
+void
+destroy_decoder_instance(uint32_t instance_id);
+
+// Holds CDM lock, for code that enters CDM other than through get(), like completions of its
+// file operations.
+class ScopedLock final
+{
+public:
+    ScopedLock();
+
+    ScopedLock(const ScopedLock &) = delete;
+
+    ScopedLock &
+    operator=(const ScopedLock &) = delete;
+
+private:
+    std::unique_lock<std::recursive_mutex> lock_;
+};
+
+// Remembers which Firefox session token the session created under |promise_id| belongs to.
+void
+set_create_session_token(uint32_t promise_id, uint32_t create_session_token);
+
+// Marks |promise_id| as belonging to a LoadSession() call, which is resolved differently from
+// CreateSession() one.
 void
-set_create_session_token(uint32_t create_session_token);
+add_load_session_promise(uint32_t promise_id);
+
+// Passes |cert| to CDM. Once CDM accepts it, the certificate is also stored, and later CDM
+// instances for the same origin get it at startup.
+void
+set_server_certificate(uint32_t promise_id, const uint8_t *cert, uint32_t cert_size);
+
+// While in scope, the first Host::Allocate() on the current thread asking for exactly |size|
+// bytes gets a recycled block taken for it up front. The block never overlaps caller's input,
+// and goes back to the pool when CDM's buffer is destroyed, or here if CDM didn't ask for it.
+class ScopedBufferLend final
+{
+public:
+    explicit ScopedBufferLend(uint32_t size);
+
+    ~ScopedBufferLend();
+
+    ScopedBufferLend(const ScopedBufferLend &) = delete;
+
+    ScopedBufferLend &
+    operator=(const ScopedBufferLend &) = delete;
+};
 
 
 class VideoFrame final : public cdm::VideoFrame
@@ -186,4 +290,43 @@ private:
     uint32_t            stride_[cdm::VideoFrame::kMaxPlanes] = {};
 };
 
+class AudioFrames final : public cdm::AudioFrames
+{
+public:
+    virtual void
+    SetFrameBuffer(cdm::Buffer *buffer) override
+    {
+        LOGF << boost::format("crcdm::AudioFrames::SetFrameBuffer buffer=%1%\n") %
+                static_cast<const void *>(buffer);
+        frame_buffer_ = buffer;
+    }
+
+    virtual cdm::Buffer *
+    FrameBuffer() override
+    {
+        LOGF << "crcdm::AudioFrames::FrameBuffer (void)\n";
+        return frame_buffer_;
+    }
+
+    virtual void
+    SetFormat(cdm::AudioFormat format) override
+    {
+        LOGF << boost::format("crcdm::AudioFrames::SetFormat format=%1%\n") % format;
+        format_ = format;
+    }
+
+    virtual cdm::AudioFormat
+    Format() const override
+    {
+        LOGF << "crcdm::AudioFrames::Format (void)\n";
+        return format_;
+    }
+
+    ~AudioFrames() { LOGF << "crcdm::AudioFrames::~AudioFrames\n"; }
+
+private:
+    cdm::AudioFormat    format_ = cdm::kUnknownAudioFormat;
+    cdm::Buffer        *frame_buffer_ = nullptr;
+};
+
 } // namespace crcdm
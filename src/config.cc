@@ -0,0 +1,98 @@
+/*
+ * Copyright © 2016  Rinat Ibragimov
+ *
+ * This file is part of gmp-widevine.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "config.hh"
+#include "log.hh"
+#include <stdio.h>
+#include <stdlib.h>
+#include <boost/format.hpp>
+
+
+using boost::format;
+
+
+namespace config {
+
+namespace {
+
+Config current_config;
+
+void
+parse_size(const char *name, uint32_t &width, uint32_t &height)
+{
+    const char *value = getenv(name);
+    if (!value)
+        return;
+
+    unsigned w = 0, h = 0;
+    if (sscanf(value, "%ux%u", &w, &h) != 2) {
+        LOGZ << format("config: can't parse %1%=%2%, expected <width>x<height>\n") % name % value;
+        return;
+    }
+
+    width = w;
+    height = h;
+}
+
+void
+parse_bool(const char *name, bool &flag)
+{
+    const char *value = getenv(name);
+    if (!value)
+        return;
+
+    unsigned v = 0;
+    if (sscanf(value, "%u", &v) != 1) {
+        LOGZ << format("config: can't parse %1%=%2%, expected 0 or 1\n") % name % value;
+        return;
+    }
+
+    flag = (v != 0);
+}
+
+} // anonymous namespace
+
+void
+load()
+{
+    Config c;
+
+    parse_size("GMP_WIDEVINE_MAX_OUTPUT_SIZE", c.max_output_width, c.max_output_height);
+    parse_bool("GMP_WIDEVINE_DECRYPT_ONLY_VIDEO", c.decrypt_only_video);
+    parse_bool("GMP_WIDEVINE_SUPPRESS_DUPLICATE_REQUESTS", c.suppress_duplicate_requests);
+
+    LOGF << format("config::load max_output_size=%1%x%2%, decrypt_only_video=%3%, "
+            "suppress_duplicate_requests=%4%\n") % c.max_output_width % c.max_output_height %
+            c.decrypt_only_video % c.suppress_duplicate_requests;
+
+    current_config = c;
+}
+
+const Config &
+get()
+{
+    return current_config;
+}
+
+} // namespace config
@@ -0,0 +1,56 @@
+/*
+ * Copyright © 2016  Rinat Ibragimov
+ *
+ * This file is part of gmp-widevine.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+
+namespace config {
+
+// Adapter settings. They are read from environment variables once, in GMPInit(), since process
+// environment is not going to change afterwards.
+struct Config {
+    // GMP_WIDEVINE_MAX_OUTPUT_SIZE=<width>x<height>. Decoded video is downscaled on the worker
+    // thread to fit into this box. Zero means no limit.
+    uint32_t    max_output_width = 0;
+    uint32_t    max_output_height = 0;
+
+    // GMP_WIDEVINE_DECRYPT_ONLY_VIDEO=1. Advertise decrypt-only capability for video, so Firefox
+    // gets back compressed frames and decodes them with its own (possibly hardware) decoders.
+    bool        decrypt_only_video = false;
+
+    // GMP_WIDEVINE_SUPPRESS_DUPLICATE_REQUESTS=1. CreateSession() with cenc init data whose key
+    // ids are all usable in an already open session gets an alias of that session instead of
+    // a new license request.
+    bool        suppress_duplicate_requests = false;
+};
+
+void
+load();
+
+const Config &
+get();
+
+} // namespace config
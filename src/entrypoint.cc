@@ -29,6 +29,7 @@
 #include <api/gmp/gmp-entrypoints.h>
 #include "firefoxcdm.hh"
 #include "chromecdm.hh"
+#include "config.hh"
 #include "log.hh"
 
 
@@ -43,6 +44,10 @@ GMPInit(const GMPPlatformAPI *aPlatformAPI)
 {
     LOGF << format("GMPInit aPlatformAPI=%1%\n") % aPlatformAPI;
     fxcdm::set_platform_api(aPlatformAPI);
+    config::load();
+
+    // CDM module startup is slow; get it going while Firefox sets up the decryptor
+    crcdm::prewarm();
 
     return GMPNoErr;
 }
@@ -89,6 +94,7 @@ void
 GMPShutdown()
 {
     LOGF << "GMPShutdown\n";
+    crcdm::Shutdown();
 }
 
 } // extern "C"
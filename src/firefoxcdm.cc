@@ -25,12 +25,21 @@
 #include <string>
 #include <vector>
 #include <string.h>
+#include <algorithm>
+#include <cstdlib>
 #include "firefoxcdm.hh"
 #include "chromecdm.hh"
+#include "audio.hh"
+#include "config.hh"
+#include "pssh.hh"
 #include "log.hh"
 #include <arpa/inet.h>
 #include <lib/gmp-task-utils.h>
 #include <lib/AnnexB.h>
+#include <mutex>
+#include "h264.hh"
+#include "planes.hh"
+#include "vpx.hh"
 
 
 namespace fxcdm {
@@ -46,12 +55,169 @@ using std::make_shared;
 const GMPPlatformAPI *platform_api = nullptr;
 GMPDecryptorCallback *host_interface = nullptr;
 
+// All guarded by decoders_mutex. CDM calls back into us holding CDM lock, which then takes
+// decoders_mutex, so CDM must never be called with decoders_mutex held.
+std::mutex    decoders_mutex;
+Module       *module_instance = nullptr;
+std::vector<VideoDecoder *> video_decoders;
+std::vector<AudioDecoder *> audio_decoders;
+
 GMPDecryptorCallback *
 host()
 {
     return host_interface;
 }
 
+void
+deferred_initialization_done(uint32_t instance_id, cdm::StreamType stream_type,
+                             cdm::Status decoder_status)
+{
+    LOGF << format("fxcdm::deferred_initialization_done instance_id=%1%, stream_type=%2%, "
+            "decoder_status=%3%\n") % instance_id % stream_type % decoder_status;
+
+    std::lock_guard<std::mutex> lock(decoders_mutex);
+
+    // an instance has at most one decoder of each kind
+    switch (stream_type) {
+    case cdm::kStreamTypeVideo:
+        for (auto decoder: video_decoders) {
+            if (decoder->CdmInstanceId() == instance_id) {
+                platform_api->runonmainthread(
+                    WrapTaskRefCounted(decoder, &VideoDecoder::DeferredInitializationDone,
+                                       decoder_status));
+            }
+        }
+        break;
+
+    case cdm::kStreamTypeAudio:
+        for (auto decoder: audio_decoders) {
+            if (decoder->CdmInstanceId() == instance_id) {
+                platform_api->runonmainthread(
+                    WrapTaskRefCounted(decoder, &AudioDecoder::DeferredInitializationDone,
+                                       decoder_status));
+            }
+        }
+        break;
+    }
+}
+
+void
+release_cdm_if_unused()
+{
+    {
+        std::lock_guard<std::mutex> lock(decoders_mutex);
+        if (module_instance || !video_decoders.empty() || !audio_decoders.empty())
+            return;
+    }
+
+    // CDM may call back into us while being destroyed, which takes decoders_mutex again
+    crcdm::Deinitialize();
+}
+
+void
+session_closed(const std::string &session_id)
+{
+    std::lock_guard<std::mutex> lock(decoders_mutex);
+
+    if (module_instance)
+        module_instance->SessionClosed(session_id);
+}
+
+void
+session_keys_changed(const std::string &session_id, const KeyStatuses &statuses)
+{
+    std::lock_guard<std::mutex> lock(decoders_mutex);
+
+    if (module_instance)
+        module_instance->SessionKeysChanged(session_id, statuses);
+}
+
+void
+session_expiration_changed(const std::string &session_id, int64_t expiry_ms)
+{
+    std::lock_guard<std::mutex> lock(decoders_mutex);
+
+    if (module_instance)
+        module_instance->SessionExpirationChanged(session_id, expiry_ms);
+}
+
+void
+output_produced()
+{
+    std::lock_guard<std::mutex> lock(decoders_mutex);
+
+    if (module_instance)
+        module_instance->OutputProduced();
+}
+
+void
+keys_became_usable(const std::vector<keys::KeyId> &key_ids)
+{
+    LOGF << format("fxcdm::keys_became_usable key_ids.size()=%1%\n") % key_ids.size();
+
+    std::lock_guard<std::mutex> lock(decoders_mutex);
+
+    if (module_instance) {
+        platform_api->runonmainthread(
+            WrapTaskRefCounted(module_instance, &Module::KeysBecameUsable, key_ids));
+    }
+
+    for (auto decoder: video_decoders) {
+        platform_api->runonmainthread(
+            WrapTaskRefCounted(decoder, &VideoDecoder::KeysBecameUsable, key_ids));
+    }
+
+    for (auto decoder: audio_decoders) {
+        platform_api->runonmainthread(
+            WrapTaskRefCounted(decoder, &AudioDecoder::KeysBecameUsable, key_ids));
+    }
+}
+
+void
+log_park_stats(const char *name, const ParkStats &stats)
+{
+    LOGS << format("%1%: samples parked waiting for key: %2%, resumed: %3%, overflows: %4%, park "
+            "time: %5% ms total, %6% ms max\n") % name % stats.samples_parked %
+            stats.samples_resumed % stats.overflows % stats.park_time_ms % stats.max_park_time_ms;
+}
+
+void
+log_deferred_init_stats(const char *decoder_name, const DeferredInitStats &stats)
+{
+    LOGS << format("%1%: deferred initializations: %2% (%3% completed, %4% failed, "
+            "%5% timed out), waited %6% ms; frames held: %7%, resumed: %8%, dropped: %9%\n") %
+            decoder_name % stats.deferred_count % stats.completed_count % stats.failed_count %
+            stats.timeout_count % stats.wait_time_ms % stats.frames_held % stats.frames_resumed %
+            stats.frames_dropped;
+}
+
+int64_t
+ms_since(std::chrono::steady_clock::time_point t)
+{
+    auto d = std::chrono::steady_clock::now() - t;
+    return std::chrono::duration_cast<std::chrono::milliseconds>(d).count();
+}
+
+bool
+is_clear_sample(const GMPEncryptedBufferMetadata *metadata)
+{
+    if (!metadata || metadata->KeyIdSize() == 0)
+        return true;
+
+    // no subsamples means whole sample is encrypted
+    const uint32_t num_subsamples = metadata->NumSubsamples();
+    if (num_subsamples == 0)
+        return false;
+
+    const uint32_t *cipher_bytes = metadata->CipherBytes();
+    for (uint32_t k = 0; k < num_subsamples; k ++) {
+        if (cipher_bytes[k] != 0)
+            return false;
+    }
+
+    return true;
+}
+
 GMPErr
 to_GMPErr(cdm::Status status)
 {
@@ -109,6 +275,65 @@ private:
     cdm::Buffer *buffer_    = nullptr;
 };
 
+// Picks CDM instance for a new decoder of the kind in |decoders|: the main one, unless another
+// decoder uses its decoder already, or else a new instance of its own. Returns zero if there is
+// none. Main thread only.
+template <typename Decoder>
+uint32_t
+choose_cdm_instance(const std::vector<Decoder *> &decoders, bool &own)
+{
+    const uint32_t main_id = crcdm::instance_id();
+    own = false;
+
+    {
+        std::lock_guard<std::mutex> lock(decoders_mutex);
+        bool main_taken = false;
+        for (auto decoder: decoders)
+            main_taken = main_taken || (decoder->CdmInstanceId() == main_id);
+
+        if (main_id == 0 || !main_taken)
+            return main_id;
+    }
+
+    LOGF << "   main CDM instance is decoding another stream, creating one more\n";
+    const uint32_t id = crcdm::create_decoder_instance();
+    own = (id != 0);
+
+    return id;
+}
+
+// Decrypts sample for a decoder with CDM instance of its own, which has no keys. Main instance
+// decrypts it into |clear|, and |inp_buf| is changed to point there, with no encryption.
+cdm::Status
+decrypt_on_main_instance(cdm::InputBuffer &inp_buf, std::vector<uint8_t> &clear)
+{
+    if (inp_buf.key_id_size == 0)
+        return cdm::kSuccess;
+
+    DecryptedBlockImpl decrypted_block;
+    cdm::Status status = crcdm::get() ? crcdm::get()->Decrypt(inp_buf, &decrypted_block)
+                                      : cdm::kDecryptError;
+    if (status != cdm::kSuccess)
+        return status;
+
+    cdm::Buffer *decrypted_buffer = decrypted_block.DecryptedBuffer();
+    if (!decrypted_buffer)
+        return cdm::kDecryptError;
+
+    clear.assign(decrypted_buffer->Data(), decrypted_buffer->Data() + decrypted_buffer->Size());
+
+    inp_buf.data = clear.data();
+    inp_buf.data_size = clear.size();
+    inp_buf.key_id = nullptr;
+    inp_buf.key_id_size = 0;
+    inp_buf.iv = nullptr;
+    inp_buf.iv_size = 0;
+    inp_buf.subsamples = nullptr;
+    inp_buf.num_subsamples = 0;
+
+    return cdm::kSuccess;
+}
+
 
 Module::Module()
 {
@@ -124,10 +349,36 @@ Module::Init(GMPDecryptorCallback *aCallback)
 {
     LOGF << format("fxcdm::Module::Init aCallback=%1%\n") % aCallback;
     host_interface = aCallback;
-    fxcdm::host()->SetCapabilities(GMP_EME_CAP_DECRYPT_AUDIO |
-                                   GMP_EME_CAP_DECRYPT_AND_DECODE_VIDEO);
 
-    crcdm::Initialize();
+    {
+        std::lock_guard<std::mutex> lock(decoders_mutex);
+        module_instance = this;
+    }
+
+    if (!crcdm::Initialize()) {
+        // CDM library is loaded at runtime and may be missing; Firefox won't route any media
+        // here without capabilities, and session calls are rejected
+        LOGZ << "   CDM is not available, advertising no capabilities\n";
+        return;
+    }
+
+    // In decrypt-only mode video samples come through Decrypt() and are returned to Firefox
+    // still compressed, which lets it pick its own decoder.
+    const uint64_t video_caps = config::get().decrypt_only_video
+                                    ? GMP_EME_CAP_DECRYPT_VIDEO
+                                    : GMP_EME_CAP_DECRYPT_AND_DECODE_VIDEO;
+    fxcdm::host()->SetCapabilities(GMP_EME_CAP_DECRYPT_AND_DECODE_AUDIO | video_caps);
+}
+
+bool
+Module::RejectIfNoCdm(uint32_t promise_id)
+{
+    if (crcdm::get())
+        return false;
+
+    const string msg {"CDM is not available"};
+    fxcdm::host()->RejectPromise(promise_id, kGMPInvalidStateError, msg.c_str(), msg.size());
+    return true;
 }
 
 void
@@ -158,7 +409,26 @@ Module::CreateSession(uint32_t aCreateSessionToken, uint32_t aPromiseId, const c
         LOGZ << "   unknown init data type '" << init_data_type_str << "'\n";
     }
 
-    crcdm::set_create_session_token(aCreateSessionToken);
+    if (RejectIfNoCdm(aPromiseId))
+        return;
+
+    SessionRequested(false);
+    license_request_stats_.sessions_created ++;
+
+    if (init_data_type == cdm::kCenc) {
+        const auto key_ids = pssh::parse_key_ids(aInitData, aInitDataSize);
+        if (!key_ids.empty())
+            license_request_stats_.with_key_ids ++;
+
+        if (config::get().suppress_duplicate_requests && !key_ids.empty() &&
+            aSessionType == kGMPTemporySession &&
+            CreateAliasSession(aCreateSessionToken, aPromiseId, key_ids))
+        {
+            return;
+        }
+    }
+
+    crcdm::set_create_session_token(aPromiseId, aCreateSessionToken);
     crcdm::get()->CreateSessionAndGenerateRequest(
                         aPromiseId,
                         aSessionType == kGMPPersistentSession ? cdm::kPersistentLicense
@@ -166,10 +436,133 @@ Module::CreateSession(uint32_t aCreateSessionToken, uint32_t aPromiseId, const c
                         init_data_type, aInitData, aInitDataSize);
 }
 
+bool
+Module::CreateAliasSession(uint32_t create_session_token, uint32_t promise_id,
+                           const vector<keys::KeyId> &key_ids)
+{
+    string source_session_id;
+    if (!keys::find_session_with_usable(key_ids, source_session_id))
+        return false;
+
+    const string alias_id = (format("alias-%1%") % next_alias_id_ ++).str();
+    alias_sessions_[alias_id] = AliasSession{source_session_id, key_ids};
+    license_request_stats_.suppressed ++;
+
+    LOGF << format("   keys are usable in session %1% already, created %2% instead of license "
+            "request\n") % source_session_id % alias_id;
+
+    fxcdm::host()->SetSessionId(create_session_token, alias_id.c_str(), alias_id.size());
+    fxcdm::host()->ResolveLoadSessionPromise(promise_id, true);
+
+    // keys are shared with the source session, and that's what page sees as the session state
+    for (const auto &key_id: key_ids) {
+        fxcdm::host()->KeyStatusChanged(alias_id.c_str(), alias_id.size(), key_id.data(),
+                                        key_id.size(), kGMPUsable);
+    }
+
+    return true;
+}
+
+void
+Module::SessionClosed(const string &session_id)
+{
+    LOGF << format("fxcdm::Module::SessionClosed session_id=%1%\n") % session_id;
+
+    for (auto it = alias_sessions_.begin(); it != alias_sessions_.end(); ) {
+        if (it->second.source_session_id != session_id) {
+            ++ it;
+            continue;
+        }
+
+        // keys are gone with their session
+        fxcdm::host()->SessionClosed(it->first.c_str(), it->first.size());
+        it = alias_sessions_.erase(it);
+    }
+}
+
+void
+Module::SessionKeysChanged(const string &session_id, const KeyStatuses &statuses)
+{
+    LOGF << format("fxcdm::Module::SessionKeysChanged session_id=%1%, statuses.size()=%2%\n") %
+            session_id % statuses.size();
+
+    for (const auto &it: alias_sessions_) {
+        const AliasSession &alias = it.second;
+        if (alias.source_session_id != session_id)
+            continue;
+
+        // alias only ever reported keys it was created for
+        for (const auto &key_status: statuses) {
+            const keys::KeyId &key_id = key_status.first;
+            if (std::find(alias.key_ids.begin(), alias.key_ids.end(), key_id) ==
+                alias.key_ids.end())
+            {
+                continue;
+            }
+
+            fxcdm::host()->KeyStatusChanged(it.first.c_str(), it.first.size(), key_id.data(),
+                                            key_id.size(), key_status.second);
+        }
+    }
+}
+
+void
+Module::SessionExpirationChanged(const string &session_id, int64_t expiry_ms)
+{
+    LOGF << format("fxcdm::Module::SessionExpirationChanged session_id=%1%, expiry_ms=%2%\n") %
+            session_id % expiry_ms;
+
+    for (const auto &it: alias_sessions_) {
+        if (it.second.source_session_id == session_id)
+            fxcdm::host()->ExpirationChange(it.first.c_str(), it.first.size(), expiry_ms);
+    }
+}
+
 void
 Module::LoadSession(uint32_t aPromiseId, const char *aSessionId, uint32_t aSessionIdLength)
 {
-    LOGZ << "fxcdm::Module::LoadSession\n";
+    LOGF << format("fxcdm::Module::LoadSession aPromiseId=%1%, aSessionId=%2%, "
+            "aSessionIdLength=%3%\n") % aPromiseId % string(aSessionId, aSessionIdLength) %
+            aSessionIdLength;
+
+    if (!fxcdm::host()) {
+        LOGZ << "   no decryptor_cb_ yet\n";
+        return;
+    }
+
+    if (RejectIfNoCdm(aPromiseId))
+        return;
+
+    SessionRequested(true);
+
+    // CDM reads the stored license through FileIO; Firefox only persists sessions of
+    // kGMPPersistentSession type, which is the only type LoadSession() is called for
+    crcdm::add_load_session_promise(aPromiseId);
+    crcdm::get()->LoadSession(aPromiseId, cdm::kPersistentLicense, aSessionId, aSessionIdLength);
+}
+
+void
+Module::SessionRequested(bool loaded)
+{
+    if (first_frame_timing_.session_requested)
+        return;
+
+    first_frame_timing_.session_requested = true;
+    first_frame_timing_.session_loaded = loaded;
+    first_frame_timing_.requested_at = std::chrono::steady_clock::now();
+}
+
+void
+Module::OutputProduced()
+{
+    if (!first_frame_timing_.session_requested || first_frame_timing_.first_frame_seen)
+        return;
+
+    first_frame_timing_.first_frame_seen = true;
+    LOGS << format("decryptor: first frame %1% ms after %2%\n") %
+            ms_since(first_frame_timing_.requested_at) %
+            (first_frame_timing_.session_loaded ? "loading persistent session"
+                                                : "creating new session");
 }
 
 void
@@ -181,6 +574,15 @@ Module::UpdateSession(uint32_t aPromiseId, const char *aSessionId, uint32_t aSes
             string(aSessionId, aSessionIdLength) % aSessionIdLength %
             static_cast<const void *>(aResponse) % aResponseSize;
 
+    if (alias_sessions_.count(string(aSessionId, aSessionIdLength)) > 0) {
+        const string msg {"session never sent a license request"};
+        fxcdm::host()->RejectPromise(aPromiseId, kGMPInvalidStateError, msg.c_str(), msg.size());
+        return;
+    }
+
+    if (RejectIfNoCdm(aPromiseId))
+        return;
+
     crcdm::get()->UpdateSession(aPromiseId, aSessionId, aSessionIdLength, aResponse, aResponseSize);
 }
 
@@ -191,20 +593,57 @@ Module::CloseSession(uint32_t aPromiseId, const char *aSessionId, uint32_t aSess
             "aSessionIdLength=%3%\n") % aPromiseId % string(aSessionId, aSessionIdLength) %
             aSessionIdLength;
 
+    auto it = alias_sessions_.find(string(aSessionId, aSessionIdLength));
+    if (it != alias_sessions_.end()) {
+        alias_sessions_.erase(it);
+        fxcdm::host()->ResolvePromise(aPromiseId);
+        fxcdm::host()->SessionClosed(aSessionId, aSessionIdLength);
+        return;
+    }
+
+    if (RejectIfNoCdm(aPromiseId))
+        return;
+
     crcdm::get()->CloseSession(aPromiseId, aSessionId, aSessionIdLength);
 }
 
 void
 Module::RemoveSession(uint32_t aPromiseId, const char *aSessionId, uint32_t aSessionIdLength)
 {
-    LOGZ << "fxcdm::Module::RemoveSession\n";
+    LOGF << format("fxcdm::Module::RemoveSession aPromiseId=%1%, aSessionId=%2%, "
+            "aSessionIdLength=%3%\n") % aPromiseId % string(aSessionId, aSessionIdLength) %
+            aSessionIdLength;
+
+    if (alias_sessions_.count(string(aSessionId, aSessionIdLength)) > 0) {
+        // aliases are only made for temporary sessions, which can't be removed
+        const string msg {"not a persistent session"};
+        fxcdm::host()->RejectPromise(aPromiseId, kGMPInvalidAccessError, msg.c_str(), msg.size());
+        return;
+    }
+
+    if (RejectIfNoCdm(aPromiseId))
+        return;
+
+    crcdm::get()->RemoveSession(aPromiseId, aSessionId, aSessionIdLength);
 }
 
 void
 Module::SetServerCertificate(uint32_t aPromiseId, const uint8_t *aServerCert,
                              uint32_t aServerCertSize)
 {
-    LOGZ << "fxcdm::Module::SetServerCertificate\n";
+    LOGF << format("fxcdm::Module::SetServerCertificate aPromiseId=%1%, aServerCert=%2%, "
+            "aServerCertSize=%3%\n") % aPromiseId % static_cast<const void *>(aServerCert) %
+            aServerCertSize;
+
+    if (!fxcdm::host()) {
+        LOGZ << "   no decryptor_cb_ yet\n";
+        return;
+    }
+
+    if (RejectIfNoCdm(aPromiseId))
+        return;
+
+    crcdm::set_server_certificate(aPromiseId, aServerCert, aServerCertSize);
 }
 
 void
@@ -215,19 +654,29 @@ Module::Decrypt(GMPBuffer *aBuffer, GMPEncryptedBufferMetadata *aMetadata)
     LOGF << format("   aBuffer->Id() = %u, aBuffer->Size() = %u\n") % aBuffer->Id() %
             aBuffer->Size();
 
-    cdm::InputBuffer    encrypted_buffer;
+    auto call_start = std::chrono::steady_clock::now();
+
+    auto job = make_shared<DecryptJob>();
+    job->buffer = aBuffer;
 
-    encrypted_buffer.data =      aBuffer->Data();
-    encrypted_buffer.data_size = aBuffer->Size();
+    decrypt_stats_.samples ++;
 
-    encrypted_buffer.key_id =      aMetadata->KeyId();
-    encrypted_buffer.key_id_size = aMetadata->KeyIdSize();
+    if (is_clear_sample(aMetadata)) {
+        LOGF << "   sample is not encrypted\n";
+        decrypt_stats_.clear_samples ++;
 
-    encrypted_buffer.iv =      aMetadata->IV();
-    encrypted_buffer.iv_size = aMetadata->IVSize();
+        if (jobs_in_flight_ == 0) {
+            fxcdm::host()->Decrypted(aBuffer, GMPNoErr);
+            decrypt_stats_.main_thread_us +=
+                std::chrono::duration_cast<std::chrono::microseconds>(
+                    std::chrono::steady_clock::now() - call_start).count();
+            return;
+        }
 
-    encrypted_buffer.num_subsamples = aMetadata->NumSubsamples();
-    vector<cdm::SubsampleEntry> subsamples;
+        // earlier samples are still being decrypted; completing this one through the same queue
+        // keeps Decrypted() calls in order
+        job->clear = true;
+    }
 
     LOGF << format("   key = %1%\n") % to_hex_string(aMetadata->KeyId(), aMetadata->KeyIdSize());
     LOGF << format("   IV = %1%\n") % to_hex_string(aMetadata->IV(), aMetadata->IVSize());
@@ -235,94 +684,395 @@ Module::Decrypt(GMPBuffer *aBuffer, GMPEncryptedBufferMetadata *aMetadata)
             subsamples_to_string(aMetadata->NumSubsamples(), aMetadata->ClearBytes(),
                                  aMetadata->CipherBytes());
 
-    for (uint32_t k = 0; k < encrypted_buffer.num_subsamples; k ++)
-        subsamples.emplace_back(aMetadata->ClearBytes()[k], aMetadata->CipherBytes()[k]);
+    if (!job->clear) {
+        job->key_id.assign(aMetadata->KeyId(), aMetadata->KeyId() + aMetadata->KeyIdSize());
+        job->iv.assign(aMetadata->IV(), aMetadata->IV() + aMetadata->IVSize());
 
-    encrypted_buffer.subsamples = &subsamples[0];
+        const uint32_t num_subsamples = aMetadata->NumSubsamples();
+        const uint16_t *clear_bytes =  aMetadata->ClearBytes();
+        const uint32_t *cipher_bytes = aMetadata->CipherBytes();
+        job->subsamples.reserve(num_subsamples);
+        for (uint32_t k = 0; k < num_subsamples; k ++)
+            job->subsamples.emplace_back(clear_bytes[k], cipher_bytes[k]);
 
-    platform_api->getcurrenttime(&encrypted_buffer.timestamp);
-    encrypted_buffer.timestamp *= 1000;
+        GMPTimestamp now = 0;
+        platform_api->getcurrenttime(&now);
+        job->timestamp = now * 1000;
+    }
 
-    DecryptedBlockImpl decrypted_block;
-    cdm::Status decode_status = crcdm::get()->Decrypt(encrypted_buffer, &decrypted_block);
+    if (!decrypt_thread_) {
+        platform_api->createthread(&decrypt_thread_);
+        if (!decrypt_thread_)
+            LOGZ << "   failed to create decrypt thread, decrypting on main thread\n";
+    }
 
-    LOGF << "    decode_status = " << decode_status << "\n";
+    jobs_in_flight_ ++;
+    decrypt_stats_.queue_depth_sum += jobs_in_flight_;
+    decrypt_stats_.max_queue_depth = std::max(decrypt_stats_.max_queue_depth, jobs_in_flight_);
+
+    if (decrypt_thread_) {
+        bool post_task;
+        {
+            std::lock_guard<std::mutex> lock(pending_mutex_);
+            pending_jobs_.push_back(job);
+            post_task = !decrypt_task_posted_;
+            decrypt_task_posted_ = true;
+        }
 
-    if (decode_status == cdm::kSuccess) {
-        auto decrypted_buffer = decrypted_block.DecryptedBuffer();
+        if (post_task)
+            decrypt_thread_->Post(WrapTaskRefCounted(this, &Module::DecryptBatchTask));
+    } else {
+        DecryptBatch batch {job};
+        ProcessBatch(batch);
+    }
+
+    decrypt_stats_.main_thread_us += std::chrono::duration_cast<std::chrono::microseconds>(
+                                        std::chrono::steady_clock::now() - call_start).count();
+}
 
-        aBuffer->Resize(decrypted_buffer->Size());
-        memcpy(aBuffer->Data(), decrypted_buffer->Data(), decrypted_buffer->Size());
+void
+Module::DecryptBatchTask()
+{
+    LOGF << "fxcdm::Module::DecryptBatchTask (void)\n";
 
-        // TODO: error handling
-        fxcdm::host()->Decrypted(aBuffer, GMPNoErr);
-        return;
+    DecryptBatch batch;
+    {
+        std::lock_guard<std::mutex> lock(pending_mutex_);
+        batch.swap(pending_jobs_);
+        decrypt_task_posted_ = false;
     }
 
-    // TODO: error handling
-    fxcdm::host()->Decrypted(aBuffer, to_GMPErr(decode_status));
+    ProcessBatch(batch);
 }
 
 void
-Module::DecryptingComplete()
+Module::ProcessBatch(DecryptBatch &batch)
 {
-    LOGF << "fxcdm::Module::DecryptingComplete (void)\n";
+    LOGF << format("fxcdm::Module::ProcessBatch batch.size()=%1%\n") % batch.size();
 
-    crcdm::Deinitialize();
+    if (batch.empty() && parked_jobs_.empty())
+        return;
 
-    Release();
+    DecryptBatch completed;
+    completed.reserve(batch.size());
+
+    uint32_t decrypted_count = 0;
+    auto batch_start = std::chrono::steady_clock::now();
+
+    auto run_job = [&](const shared_ptr<DecryptJob> &job) {
+        if (!job->clear) {
+            DecryptJobWithCDM(*job);
+            decrypted_count ++;
+        }
+        completed.push_back(job);
+    };
+
+    // parked jobs go before new ones, up to the first one that still waits for its key
+    auto resume_ready = [&]() {
+        while (!parked_jobs_.empty() && IsReady(*parked_jobs_.front())) {
+            auto job = parked_jobs_.front();
+            parked_jobs_.pop_front();
+
+            const int64_t parked_ms = ms_since(job->parked_since);
+            park_stats_.samples_resumed ++;
+            park_stats_.park_time_ms += parked_ms;
+            park_stats_.max_park_time_ms = std::max(park_stats_.max_park_time_ms, parked_ms);
+
+            run_job(job);
+        }
+    };
+
+    resume_ready();
+
+    for (auto &job: batch) {
+        if (parked_jobs_.size() >= kMaxParkedSamples) {
+            // let CDM fail the oldest one with kNoKey, as if there was no parking at all
+            LOGF << "   too many samples are waiting for keys\n";
+            park_stats_.overflows ++;
+            run_job(parked_jobs_.front());
+            parked_jobs_.pop_front();
+            resume_ready();
+        }
+
+        if (ParkIfKeyMissing(job))
+            continue;
+
+        run_job(job);
+    }
+
+    if (decrypted_count > 0) {
+        int bucket = 0;
+        while (bucket < kBatchSizeBuckets - 1 && decrypted_count > (1u << bucket))
+            bucket ++;
+
+        batch_stats_.batches[bucket] ++;
+        batch_stats_.samples[bucket] += decrypted_count;
+        batch_stats_.cdm_time_us[bucket] += std::chrono::duration_cast<std::chrono::microseconds>(
+                                                std::chrono::steady_clock::now() -
+                                                batch_start).count();
+    }
+
+    if (completed.empty())
+        return;
+
+    // a single main thread task completes the whole batch; main thread tasks run in the order
+    // they were posted, and samples behind a parked one are parked too, which keeps completions
+    // in submission order
+    if (decrypt_thread_) {
+        platform_api->runonmainthread(
+            WrapTaskRefCounted(this, &Module::DecryptedBatchTask, completed));
+    } else {
+        DecryptedBatchTask(completed);
+    }
 }
 
+bool
+Module::IsReady(const DecryptJob &job)
+{
+    return job.clear || keys::is_usable(job.key_id);
+}
 
-ModuleAsyncShutdown::ModuleAsyncShutdown(GMPAsyncShutdownHost *host_api)
-    : host_api_(host_api)
+bool
+Module::ParkIfKeyMissing(shared_ptr<DecryptJob> job)
 {
+    // samples behind a parked one wait too, clear ones included, to keep completion order
+    if (parked_jobs_.empty() && IsReady(*job))
+        return false;
+
+    LOGF << format("   parking sample, key = %1%, %2% parked already\n") %
+            to_hex_string(job->key_id.data(), job->key_id.size()) % parked_jobs_.size();
+
+    job->parked_since = std::chrono::steady_clock::now();
+    parked_jobs_.push_back(job);
+    park_stats_.samples_parked ++;
+
+    return true;
 }
 
 void
-ModuleAsyncShutdown::BeginShutdown()
+Module::KeysBecameUsable(std::vector<keys::KeyId> key_ids)
 {
-    LOGF << "fxcdm::ModuleAsyncShutdown::BeginShutdown (void)\n";
+    LOGF << format("fxcdm::Module::KeysBecameUsable key_ids.size()=%1%\n") % key_ids.size();
 
-    // there is nothing to close asynchronously
-    host_api_->ShutdownComplete();
+    if (decrypt_thread_ && !decrypting_complete_)
+        decrypt_thread_->Post(WrapTaskRefCounted(this, &Module::ResumeParkedTask));
 }
 
-ModuleAsyncShutdown::~ModuleAsyncShutdown()
+void
+Module::ResumeParkedTask()
 {
-    LOGF << "fxcdm::ModuleAsyncShutdown::~ModuleAsyncShutdown (void)\n";
-    // TODO: delete self?
-}
+    LOGF << format("fxcdm::Module::ResumeParkedTask parked_jobs_.size()=%1%\n") %
+            parked_jobs_.size();
 
+    DecryptBatch batch;
+    ProcessBatch(batch);
+}
 
-string
-GMPVideoCodec_to_string(const GMPVideoCodec &a)
+void
+Module::DecryptJobWithCDM(DecryptJob &job)
 {
-    std::stringstream s;
+    GMPBuffer *buffer = job.buffer;
+    cdm::InputBuffer encrypted_buffer;
 
-    s << format("{.mGMPApiVersion=%1%, .mCodecType=%2%, .mPLName=%3%, .mPLType=%4%, .mWidth=%5%, "
-         ".mHeight=%6%, .mStartBitrate=%7%, .mMaxBitrate=%8%, .mMinBitrate=%9%, .mMaxFramerate=%10%"
-         ", .mFrameDroppingOn=%11%, .mKeyFrameInterval=%12%, .mQPMax=%13%, "
-         ".mNumberOfSimulcastStreams=%14%, .mSimulcastStream={") % a.mGMPApiVersion % a.mCodecType %
-         a.mPLName % a.mPLType % a.mWidth % a.mHeight % a.mStartBitrate % a.mMaxBitrate %
-         a.mMinBitrate % a.mMaxFramerate % a.mFrameDroppingOn % a.mKeyFrameInterval % a.mQPMax %
-         a.mNumberOfSimulcastStreams;
+    encrypted_buffer.data =      buffer->Data();
+    encrypted_buffer.data_size = buffer->Size();
 
-    for (uint32_t k = 0; k < a.mNumberOfSimulcastStreams; k ++) {
-        const GMPSimulcastStream &b = a.mSimulcastStream[k];
+    encrypted_buffer.key_id =      job.key_id.data();
+    encrypted_buffer.key_id_size = job.key_id.size();
 
-        if (k > 0)
-            s << ", ";
+    encrypted_buffer.iv =      job.iv.data();
+    encrypted_buffer.iv_size = job.iv.size();
 
-        s << format("{.mWidth=%1%, .mHeight=%2%, .mNumberOfTemporalLayers=%3%, .mMaxBitrate=%4%, "
-             ".mTargetBitrate=%5%, .mMinBitrate=%6%, .mQPMax=%7%}") % b.mWidth % b.mHeight %
-             b.mNumberOfTemporalLayers % b.mMaxBitrate % b.mTargetBitrate % b.mMinBitrate %
-             b.mQPMax;
-    }
+    // |data()| is safe for whole-sample encryption too, where there are no subsamples
+    encrypted_buffer.subsamples =     job.subsamples.data();
+    encrypted_buffer.num_subsamples = job.subsamples.size();
 
-    s << format("}, .mMode=%1%}") % a.mMode;
+    encrypted_buffer.timestamp = job.timestamp;
 
-    return s.str();
+    DecryptedBlockImpl decrypted_block;
+    cdm::Status decode_status;
+
+    {
+        // output goes to a recycled block, never to GMPBuffer itself: CDM isn't known to cope
+        // with output overlapping its input
+        crcdm::ScopedBufferLend lend(buffer->Size());
+        decode_status = crcdm::get() ? crcdm::get()->Decrypt(encrypted_buffer, &decrypted_block)
+                                     : cdm::kDecryptError;
+    }
+
+    LOGF << "    decode_status = " << decode_status << "\n";
+
+    job.result = to_GMPErr(decode_status);
+
+    if (decode_status == cdm::kSuccess) {
+        auto decrypted_buffer = decrypted_block.DecryptedBuffer();
+
+        if (decrypted_buffer) {
+            // decrypted data is the same size as encrypted one, so resizing is almost never
+            // needed; video frames are large enough for a spare reallocation to be noticeable
+            const uint32_t decrypted_size = decrypted_buffer->Size();
+
+            if (buffer->Size() != decrypted_size)
+                buffer->Resize(decrypted_size);
+
+            if (buffer->Size() != decrypted_size) {
+                // Resize() has no status of its own; a buffer that didn't grow can't take data
+                LOGZ << format("fxcdm::Module: can't resize buffer to %1% bytes\n") %
+                        decrypted_size;
+                job.result = GMPGenericErr;
+            } else {
+                memcpy(buffer->Data(), decrypted_buffer->Data(), decrypted_size);
+            }
+        } else {
+            // CDM reported success, but produced nothing
+            job.result = GMPGenericErr;
+        }
+    }
+}
+
+void
+Module::DecryptedBatchTask(DecryptBatch batch)
+{
+    LOGF << format("fxcdm::Module::DecryptedBatchTask batch.size()=%1%\n") % batch.size();
+
+    auto call_start = std::chrono::steady_clock::now();
+
+    jobs_in_flight_ -= batch.size();
+
+    for (auto &job: batch) {
+        if (decrypting_complete_) {
+            // host callbacks must not be called after DecryptingComplete(), but buffer is still
+            // ours to free
+            delete job->buffer;
+            continue;
+        }
+
+        // each sample completes with its own status; host fails just that one
+        if (job->result != GMPNoErr) {
+            LOGZ << format("fxcdm::Module: sample at %1% failed to decrypt, error %2%\n") %
+                    job->timestamp % job->result;
+            decrypt_stats_.failed ++;
+        }
+
+        fxcdm::host()->Decrypted(job->buffer, job->result);
+
+        if (!job->clear && job->result == GMPNoErr)
+            OutputProduced();
+    }
+
+    // without worker this runs inside Decrypt(), which accounts for it already
+    if (decrypt_thread_) {
+        decrypt_stats_.main_thread_us += std::chrono::duration_cast<std::chrono::microseconds>(
+                                            std::chrono::steady_clock::now() - call_start).count();
+    }
+}
+
+void
+Module::DecryptingComplete()
+{
+    LOGF << "fxcdm::Module::DecryptingComplete (void)\n";
+
+    decrypting_complete_ = true;
+
+    {
+        std::lock_guard<std::mutex> lock(decoders_mutex);
+        if (module_instance == this)
+            module_instance = nullptr;
+    }
+
+    if (decrypt_thread_) {
+        decrypt_thread_->Join();
+        decrypt_thread_ = nullptr;
+    }
+
+    // worker is gone, samples still waiting for keys can't be returned to host anymore
+    for (auto &job: parked_jobs_)
+        delete job->buffer;
+    parked_jobs_.clear();
+
+    log_park_stats("decryptor", park_stats_);
+
+    static const char *bucket_names[kBatchSizeBuckets] = {"1", "2", "3-4", "5-8", "9-16", "17+"};
+    for (int k = 0; k < kBatchSizeBuckets; k ++) {
+        if (batch_stats_.batches[k] == 0)
+            continue;
+        LOGS << format("decryptor: batches of %1%: %2%, samples: %3%, CDM time per sample: "
+                "%4% us\n") % bucket_names[k] % batch_stats_.batches[k] %
+                batch_stats_.samples[k] % (batch_stats_.cdm_time_us[k] / batch_stats_.samples[k]);
+    }
+
+    if (license_request_stats_.sessions_created > 0) {
+        LOGS << format("decryptor: sessions created: %1%, with key ids in PSSH: %2%, license "
+                "requests suppressed as duplicates: %3%\n") %
+                license_request_stats_.sessions_created % license_request_stats_.with_key_ids %
+                license_request_stats_.suppressed;
+    }
+
+    if (decrypt_stats_.samples > 0) {
+        LOGS << format("decryptor: samples: %1% (%6% clear), main thread time per sample: %2% us, "
+                "queue depth: average %3%, max %4%, failed: %5%\n") %
+                decrypt_stats_.samples %
+                (decrypt_stats_.main_thread_us / decrypt_stats_.samples) %
+                (double(decrypt_stats_.queue_depth_sum) / decrypt_stats_.samples) %
+                decrypt_stats_.max_queue_depth % decrypt_stats_.failed %
+                decrypt_stats_.clear_samples;
+    }
+
+    release_cdm_if_unused();
+
+    Release();
+}
+
+
+ModuleAsyncShutdown::ModuleAsyncShutdown(GMPAsyncShutdownHost *host_api)
+    : host_api_(host_api)
+{
+}
+
+void
+ModuleAsyncShutdown::BeginShutdown()
+{
+    LOGF << "fxcdm::ModuleAsyncShutdown::BeginShutdown (void)\n";
+
+    // there is nothing to close asynchronously
+    host_api_->ShutdownComplete();
+}
+
+ModuleAsyncShutdown::~ModuleAsyncShutdown()
+{
+    LOGF << "fxcdm::ModuleAsyncShutdown::~ModuleAsyncShutdown (void)\n";
+    // TODO: delete self?
+}
+
+
+string
+GMPVideoCodec_to_string(const GMPVideoCodec &a)
+{
+    std::stringstream s;
+
+    s << format("{.mGMPApiVersion=%1%, .mCodecType=%2%, .mPLName=%3%, .mPLType=%4%, .mWidth=%5%, "
+         ".mHeight=%6%, .mStartBitrate=%7%, .mMaxBitrate=%8%, .mMinBitrate=%9%, .mMaxFramerate=%10%"
+         ", .mFrameDroppingOn=%11%, .mKeyFrameInterval=%12%, .mQPMax=%13%, "
+         ".mNumberOfSimulcastStreams=%14%, .mSimulcastStream={") % a.mGMPApiVersion % a.mCodecType %
+         a.mPLName % a.mPLType % a.mWidth % a.mHeight % a.mStartBitrate % a.mMaxBitrate %
+         a.mMinBitrate % a.mMaxFramerate % a.mFrameDroppingOn % a.mKeyFrameInterval % a.mQPMax %
+         a.mNumberOfSimulcastStreams;
+
+    for (uint32_t k = 0; k < a.mNumberOfSimulcastStreams; k ++) {
+        const GMPSimulcastStream &b = a.mSimulcastStream[k];
+
+        if (k > 0)
+            s << ", ";
+
+        s << format("{.mWidth=%1%, .mHeight=%2%, .mNumberOfTemporalLayers=%3%, .mMaxBitrate=%4%, "
+             ".mTargetBitrate=%5%, .mMinBitrate=%6%, .mQPMax=%7%}") % b.mWidth % b.mHeight %
+             b.mNumberOfTemporalLayers % b.mMaxBitrate % b.mTargetBitrate % b.mMinBitrate %
+             b.mQPMax;
+    }
+
+    s << format("}, .mMode=%1%}") % a.mMode;
+
+    return s.str();
 }
 
 void
@@ -337,15 +1087,48 @@ VideoDecoder::InitDecode(const GMPVideoCodec &aCodecSettings, const uint8_t *aCo
 
     dec_cb_ = aCallback;
 
+    bool own_cdm;
+    const uint32_t cdm_id = choose_cdm_instance(video_decoders, own_cdm);
+    {
+        std::lock_guard<std::mutex> lock(decoders_mutex);
+        cdm_id_ = cdm_id;
+        own_cdm_ = own_cdm;
+        video_decoders.push_back(this);
+    }
+
+    LOGF << format("   CDM instance = %1%%2%\n") % cdm_id_ % (own_cdm_ ? " (own)" : "");
+
+    // Gecko doesn't tell decoders the size video is displayed at (simulcast streams are an
+    // encoder setting), so the limit only comes from configuration
+    max_output_width_ = config::get().max_output_width;
+    max_output_height_ = config::get().max_output_height;
+
+    LOGF << format("   max output size = %1%x%2%\n") % max_output_width_ % max_output_height_;
+
     cdm::VideoDecoderConfig video_decoder_config;
 
     switch (aCodecSettings.mCodecType) {
     default:
-    case kGMPVideoCodecVP8:
         LOGZ << "  not implemented\n";
         return;
         break;
 
+    case kGMPVideoCodecVP8:
+    case kGMPVideoCodecVP9:
+
+        // VPx frames are passed to CDM as is, there is no extra data
+        video_decoder_config.codec = (aCodecSettings.mCodecType == kGMPVideoCodecVP8)
+                                        ? cdm::VideoDecoderConfig::kCodecVp8
+                                        : cdm::VideoDecoderConfig::kCodecVp9;
+        video_decoder_config.profile = cdm::VideoDecoderConfig::kProfileNotNeeded;
+        video_decoder_config.format = cdm::kYv12;
+        video_decoder_config.coded_size.width = aCodecSettings.mWidth;
+        video_decoder_config.coded_size.height = aCodecSettings.mHeight;
+        video_decoder_config.extra_data = nullptr;
+        video_decoder_config.extra_data_size = 0;
+
+        break;
+
     case kGMPVideoCodecH264:
 
         video_decoder_config.codec = cdm::VideoDecoderConfig::kCodecH264;
@@ -364,10 +1147,144 @@ VideoDecoder::InitDecode(const GMPVideoCodec &aCodecSettings, const uint8_t *aCo
         break;
     }
 
-    // TODO: call on worker thread
-    cdm::Status status = crcdm::get()->InitializeVideoDecoder(video_decoder_config);
+    codec_ = video_decoder_config.codec;
+
+    EnsureWorkerIsRunning();
+    if (!worker_thread_)
+        return;
+
+    // Decoder initialization is done on the worker thread, so session messages and license
+    // responses don't wait for it. Decode() posts its tasks to the same thread, so they are
+    // queued behind initialization.
+    worker_thread_->Post(WrapTaskRefCounted(this, &VideoDecoder::InitTask, video_decoder_config));
+}
+
+void
+VideoDecoder::InitTask(cdm::VideoDecoderConfig video_decoder_config)
+{
+    LOGF << "fxcdm::VideoDecoder::InitTask\n";
+
+    // without CDM library there is nothing to decode with
+    cdm::Status status = crcdm::get(cdm_id_)
+                            ? crcdm::get(cdm_id_)->InitializeVideoDecoder(video_decoder_config)
+                            : cdm::kSessionError;
 
     LOGF << format("   InitializeVideoDecoder() returned %1%\n") % status;
+
+    switch (status) {
+    case cdm::kSuccess:
+        init_state_ = DecoderInitState::kInitialized;
+        break;
+
+    case cdm::kDeferredInitialization:
+        // CDM will call OnDeferredInitializationDone() later. Until then incoming frames are
+        // held in |held_frames_|.
+        init_state_ = DecoderInitState::kDeferred;
+        deferred_since_ = std::chrono::steady_clock::now();
+        deferred_init_stats_.deferred_count ++;
+        fxcdm::get_platform_api()->runonmainthread(
+            WrapTaskRefCounted(this, &VideoDecoder::ArmDeferredInitTimeout));
+        break;
+
+    default:
+        LOGZ << format("   video decoder initialization failed with status %1%\n") % status;
+        init_state_ = DecoderInitState::kFailed;
+        fxcdm::get_platform_api()->runonmainthread(
+            WrapTaskRefCounted(this, &VideoDecoder::ErrorTask, to_GMPErr(status)));
+        break;
+    }
+}
+
+void
+VideoDecoder::ArmDeferredInitTimeout()
+{
+    LOGF << "fxcdm::VideoDecoder::ArmDeferredInitTimeout (void)\n";
+
+    GMPErr err = fxcdm::get_platform_api()->settimer(
+                    WrapTaskRefCounted(this, &VideoDecoder::DeferredInitTimedOut),
+                    kDeferredInitTimeoutMs);
+    if (GMP_FAILED(err))
+        LOGZ << format("   settimer failed with code %1%\n") % err;
+}
+
+void
+VideoDecoder::DeferredInitTimedOut()
+{
+    LOGF << "fxcdm::VideoDecoder::DeferredInitTimedOut (void)\n";
+
+    if (worker_thread_)
+        worker_thread_->Post(WrapTaskRefCounted(this, &VideoDecoder::DeferredInitTimeoutTask));
+}
+
+void
+VideoDecoder::DeferredInitTimeoutTask()
+{
+    LOGF << "fxcdm::VideoDecoder::DeferredInitTimeoutTask (void)\n";
+
+    if (init_state_ != DecoderInitState::kDeferred)
+        return;
+
+    LOGZ << "   deferred video decoder initialization timed out\n";
+
+    init_state_ = DecoderInitState::kFailed;
+    deferred_init_stats_.timeout_count ++;
+    deferred_init_stats_.wait_time_ms += ms_since(deferred_since_);
+    deferred_init_stats_.frames_dropped += held_frames_.size();
+    held_frames_.clear();
+
+    fxcdm::get_platform_api()->runonmainthread(
+        WrapTaskRefCounted(this, &VideoDecoder::ErrorTask, GMPAbortedErr));
+}
+
+void
+VideoDecoder::DeferredInitializationDone(cdm::Status decoder_status)
+{
+    LOGF << format("fxcdm::VideoDecoder::DeferredInitializationDone decoder_status=%1%\n") %
+            decoder_status;
+
+    if (worker_thread_) {
+        worker_thread_->Post(WrapTaskRefCounted(this, &VideoDecoder::DeferredInitDoneTask,
+                                                decoder_status));
+    }
+}
+
+void
+VideoDecoder::DeferredInitDoneTask(cdm::Status decoder_status)
+{
+    LOGF << format("fxcdm::VideoDecoder::DeferredInitDoneTask decoder_status=%1%\n") %
+            decoder_status;
+
+    if (init_state_ != DecoderInitState::kDeferred) {
+        LOGF << "   decoder is not waiting for deferred initialization, ignoring\n";
+        return;
+    }
+
+    deferred_init_stats_.wait_time_ms += ms_since(deferred_since_);
+
+    if (decoder_status != cdm::kSuccess) {
+        LOGZ << format("   deferred video decoder initialization failed with status %1%\n") %
+                decoder_status;
+        init_state_ = DecoderInitState::kFailed;
+        deferred_init_stats_.failed_count ++;
+        deferred_init_stats_.frames_dropped += held_frames_.size();
+        held_frames_.clear();
+
+        fxcdm::get_platform_api()->runonmainthread(
+            WrapTaskRefCounted(this, &VideoDecoder::ErrorTask, to_GMPErr(decoder_status)));
+        return;
+    }
+
+    init_state_ = DecoderInitState::kInitialized;
+    deferred_init_stats_.completed_count ++;
+
+    LOGF << format("   resuming %1% held frames\n") % held_frames_.size();
+
+    std::deque<shared_ptr<DecodeData>> frames;
+    frames.swap(held_frames_);
+    deferred_init_stats_.frames_resumed += frames.size();
+
+    for (auto &ddata: frames)
+        DecodeTask(ddata);
 }
 
 void
@@ -386,33 +1303,99 @@ VideoDecoder::Decode(GMPVideoEncodedFrame *aInputFrame, bool aMissingFrames,
     LOGF << format("   BufferType() = %1%\n") % aInputFrame->BufferType();
     LOGF << format("   timestamp = %1%\n") % aInputFrame->TimeStamp();
 
+    if (aMissingFrames) {
+        LOGF << "   frames are missing, waiting for a key frame\n";
+        recovery_stats_.discontinuities ++;
+        wait_for_key_frame_ = true;
+    }
+
     auto ddata = make_shared<DecodeData>();
 
     ddata->buf_type = aInputFrame->BufferType();
-    ddata->buf.assign(aInputFrame->Buffer(), aInputFrame->Buffer() + aInputFrame->Size());
-
     ddata->is_key_frame = (aInputFrame->FrameType() == kGMPKeyFrame);
 
     const GMPEncryptedBufferMetadata *metadata = aInputFrame->GetDecryptionData();
     LOGF << format("   metadata = %1%\n") % static_cast<const void *>(metadata);
 
-    if (metadata) {
-        ddata->key_id.assign(metadata->KeyId(), metadata->KeyId() + metadata->KeyIdSize());
-        ddata->iv.assign(metadata->IV(), metadata->IV() + metadata->IVSize());
+    // clear samples (like ones in clear lead) are passed to CDM without key, IV or subsample map
+    const bool encrypted = !is_clear_sample(metadata);
 
+    if (encrypted) {
         LOGF << format("   key = %1%\n") % to_hex_string(metadata->KeyId(), metadata->KeyIdSize());
         LOGF << format("   IV = %1%\n") % to_hex_string(metadata->IV(), metadata->IVSize());
         LOGF << format("   subsamples (clear, cipher) = %1%\n") %
             subsamples_to_string(metadata->NumSubsamples(), metadata->ClearBytes(),
                                  metadata->CipherBytes());
 
-
-        for (uint32_t k = 0; k < metadata->NumSubsamples(); k ++)
+        const uint32_t num_subsamples = metadata->NumSubsamples();
+        ddata->subsamples.reserve(std::max(num_subsamples, 1u));
+        for (uint32_t k = 0; k < num_subsamples; k ++)
             ddata->subsamples.emplace_back(metadata->ClearBytes()[k], metadata->CipherBytes()[k]);
+
+        // whole-sample encryption is spelled out, so that frame inspection doesn't mistake it
+        // for clear data, and SPS/PPS insertion has a subsample to extend
+        if (num_subsamples == 0)
+            ddata->subsamples.emplace_back(0, aInputFrame->Size());
+    } else {
+        LOGF << "   sample is not encrypted\n";
+    }
+
+    bool can_start_decoding = ddata->is_key_frame;
+
+    if (codec_ == cdm::VideoDecoderConfig::kCodecH264 &&
+        ddata->buf_type == GMP_BufferLength32)
+    {
+        auto info = h264::inspect_avcc_frame(aInputFrame->Buffer(), aInputFrame->Size(),
+                                             ddata->subsamples);
+        if (info.parsed)
+            can_start_decoding = info.has_idr;
+        ddata->is_key_frame = ddata->is_key_frame || info.has_idr;
+        ddata->is_reference = ddata->is_key_frame || info.is_reference;
+        LOGF << format("   is_key_frame = %1%, is_reference = %2%, has_idr = %3%\n") %
+                ddata->is_key_frame % ddata->is_reference % info.has_idr;
+
+    } else if (codec_ == cdm::VideoDecoderConfig::kCodecVp8 ||
+               codec_ == cdm::VideoDecoderConfig::kCodecVp9)
+    {
+        auto info = (codec_ == cdm::VideoDecoderConfig::kCodecVp8)
+                        ? vpx::inspect_vp8_frame(aInputFrame->Buffer(), aInputFrame->Size(),
+                                                 ddata->subsamples)
+                        : vpx::inspect_vp9_frame(aInputFrame->Buffer(), aInputFrame->Size(),
+                                                 ddata->subsamples);
+        if (info.parsed) {
+            can_start_decoding = info.is_key_frame;
+            ddata->is_key_frame = info.is_key_frame;
+            ddata->is_reference = info.is_reference;
+        }
+        LOGF << format("   parsed = %1%, is_key_frame = %2%, is_reference = %3%, "
+                "frame_count = %4%\n") % info.parsed % ddata->is_key_frame %
+                ddata->is_reference % info.frame_count;
+    }
+
+    if (wait_for_key_frame_) {
+        if (!can_start_decoding) {
+            // decoding anything before next IDR would only waste CDM time on garbage or errors
+            LOGF << "   not a key frame, skipping\n";
+            recovery_stats_.frames_skipped ++;
+            aInputFrame->Destroy();
+            dec_cb_->InputDataExhausted();
+            return;
+        }
+
+        wait_for_key_frame_ = false;
+    }
+
+    ddata->buf.assign(aInputFrame->Buffer(), aInputFrame->Buffer() + aInputFrame->Size());
+
+    if (encrypted) {
+        ddata->key_id.assign(metadata->KeyId(), metadata->KeyId() + metadata->KeyIdSize());
+        ddata->iv.assign(metadata->IV(), metadata->IV() + metadata->IVSize());
     }
 
     ddata->timestamp = aInputFrame->TimeStamp();
     ddata->duration = aInputFrame->Duration();
+    ddata->render_time_ms = aRenderTimeMs;
+    ddata->epoch = epoch_;
 
     aInputFrame->Destroy();
 
@@ -425,16 +1408,53 @@ VideoDecoder::DecodeTask(shared_ptr<DecodeData> ddata)
 {
     LOGF << format("fxcdm::VideoDecoder::DecodeTask ddata=%1%\n") % ddata.get();
 
-    if (ddata->buf_type != 4) {
+    if (ddata->epoch != epoch_) {
+        LOGF << "   frame was queued before Reset(), dropping\n";
+        recovery_stats_.stale_frames_dropped ++;
+        return;
+    }
+
+    switch (init_state_) {
+    case DecoderInitState::kInitialized:
+        break;
+
+    case DecoderInitState::kDeferred:
+        LOGF << "   decoder initialization is deferred, holding frame\n";
+        held_frames_.push_back(ddata);
+        deferred_init_stats_.frames_held ++;
+        return;
+
+    default:
+        LOGF << "   decoder is not initialized, dropping frame\n";
+        return;
+    }
+
+    if (ParkIfKeyMissing(ddata))
+        return;
+
+    const bool is_h264 = (codec_ == cdm::VideoDecoderConfig::kCodecH264);
+
+    if (is_h264 && ddata->buf_type != GMP_BufferLength32) {
         // works only for buffer type 4, but comments in Firefox say that Gecko shouldn't
         // generate buffers of other types
         LOGZ << "   BufferType() != 4 are not implemented\n";
         return;
     }
 
-    AnnexB::ConvertFrameInPlace(ddata->buf);
+    if (IsTooLateToDecode(*ddata)) {
+        LOGF << "   non-reference frame can't make its deadline, dropping\n";
+        overload_stats_.frames_dropped ++;
+        fxcdm::get_platform_api()->runonmainthread(
+            WrapTaskRefCounted(this, &VideoDecoder::InputDataExhaustedTask, ddata->epoch));
+        return;
+    }
+
+    // VP8 and VP9 frames (including VP9 superframes, whose index is left in place for the
+    // decoder) go to CDM unchanged
+    if (is_h264)
+        AnnexB::ConvertFrameInPlace(ddata->buf);
 
-    if (ddata->is_key_frame) {
+    if (is_h264 && ddata->is_key_frame) {
         LOGF << "   is a key frame\n";
         // insert extra data
         ddata->buf.insert(ddata->buf.begin(), extra_data_annexb_.begin(), extra_data_annexb_.end());
@@ -468,23 +1488,42 @@ VideoDecoder::DecodeTask(shared_ptr<DecodeData> ddata)
     inp_buf.timestamp = ddata->timestamp;
 
     auto crvf = make_shared<crcdm::VideoFrame>();
-    cdm::Status status = crcdm::get()->DecryptAndDecodeFrame(inp_buf, crvf.get());
+    auto decode_start = std::chrono::steady_clock::now();
+
+    // each CDM call takes CDM lock on its own, so other streams get their turn in between
+    cdm::Status status = own_cdm_ ? decrypt_on_main_instance(inp_buf, ddata->buf)
+                                  : cdm::kSuccess;
+    if (status == cdm::kSuccess) {
+        status = crcdm::get(cdm_id_) ? crcdm::get(cdm_id_)->DecryptAndDecodeFrame(inp_buf,
+                                                                                 crvf.get())
+                                     : cdm::kDecodeError;
+    }
+    UpdateDecodeCost(std::chrono::steady_clock::now() - decode_start);
     LOGF << format("   DecryptAndDecodeFrame returned %1%\n") % status;
 
     if (status == cdm::kNeedMoreData) {
 
         LOGF << "   scheduling dec_cb_->InputDataExhausted()\n";
         fxcdm::get_platform_api()->runonmainthread(
-            WrapTask(dec_cb_, &GMPVideoDecoderCallback::InputDataExhausted));
+            WrapTaskRefCounted(this, &VideoDecoder::InputDataExhaustedTask, ddata->epoch));
 
     } else if (status == cdm::kSuccess) {
 
         LOGF << "   scheduling DecodedTaskCallDecoded\n";
 
-        shared_ptr<vector<uint8_t>> raw(new vector<uint8_t>);
+        overload_stats_.frames_decoded ++;
+        if (ddata->render_time_ms >= 0) {
+            GMPTimestamp now = 0;
+            fxcdm::get_platform_api()->getcurrenttime(&now);
+            if (now > ddata->render_time_ms &&
+                now - ddata->render_time_ms < kRenderTimeSanityWindowMs)
+            {
+                overload_stats_.deadline_misses ++;
+            }
+        }
+
         cdm::Size sz = crvf->Size();
         auto crbuf = crvf->FrameBuffer();
-        raw->assign(crbuf->Data(), crbuf->Data() + crbuf->Size());
 
         uint32_t y_stride = crvf->Stride(cdm::VideoFrame::kYPlane);
         uint32_t u_stride = crvf->Stride(cdm::VideoFrame::kUPlane);
@@ -494,68 +1533,263 @@ VideoDecoder::DecodeTask(shared_ptr<DecodeData> ddata)
         uint32_t u_offset = crvf->PlaneOffset(cdm::VideoFrame::kUPlane);
         uint32_t v_offset = crvf->PlaneOffset(cdm::VideoFrame::kVPlane);
 
+        LOGF << format("   format=%1%, sz={.width=%2%, .height=%3%}, y_offset=%4%, u_offset=%5%, "
+                "v_offset=%6%, y_stride=%7%, u_stride=%8%, v_stride=%9%\n") % crvf->Format() %
+                sz.width % sz.height % y_offset % u_offset % v_offset % y_stride % u_stride %
+                v_stride;
+
         // TODO: why widevine provides invalid offsets when AddressSanitizer is used?
         // uint32_t y_offset = 0;
         // uint32_t v_offset = y_offset + y_stride * sz.height;
         // uint32_t u_offset = v_offset + v_stride * sz.height / 2;
 
-        crvf->FrameBuffer()->Destroy();
+        const uint32_t chroma_width = (sz.width + 1) / 2;
+        const uint32_t chroma_height = (sz.height + 1) / 2;
+        auto plane_fits = [crbuf](uint32_t offset, uint32_t stride, uint32_t width,
+                                  uint32_t height)
+        {
+            return stride >= width && height > 0 &&
+                   uint64_t(offset) + uint64_t(stride) * (height - 1) + width <= crbuf->Size();
+        };
+
+        shared_ptr<planes::I420Image> img;
+
+        if (sz.width > 0 && sz.height > 0 &&
+            plane_fits(y_offset, y_stride, sz.width, sz.height) &&
+            plane_fits(u_offset, u_stride, chroma_width, chroma_height) &&
+            plane_fits(v_offset, v_stride, chroma_width, chroma_height))
+        {
+            planes::PlaneRef y_plane{crbuf->Data() + y_offset, y_stride};
+            planes::PlaneRef u_plane{crbuf->Data() + u_offset, u_stride};
+            planes::PlaneRef v_plane{crbuf->Data() + v_offset, v_stride};
+            cdm::Size out_sz = OutputSize(sz);
+
+            // planes are repacked (or scaled) here, on the worker, so neither main thread copy
+            // nor IPC have to deal with CDM's stride padding or with pixels nobody will see
+            if (out_sz.width != sz.width || out_sz.height != sz.height) {
+                img = planes::scale_i420(sz.width, sz.height, y_plane, u_plane, v_plane,
+                                         out_sz.width, out_sz.height);
+            } else {
+                img = planes::repack_i420(sz.width, sz.height, y_plane, u_plane, v_plane);
+            }
+        } else {
+            LOGZ << "   CDM returned frame with inconsistent plane layout\n";
+        }
+
+        crbuf->Destroy();
+
+        if (!img) {
+            fxcdm::get_platform_api()->runonmainthread(
+                WrapTaskRefCounted(this, &VideoDecoder::ErrorTask, GMPDecodeErr));
+            return;
+        }
 
         fxcdm::get_platform_api()->runonmainthread(
-            WrapTaskRefCounted(this, &VideoDecoder::DecodedTaskCallDecoded, raw, sz, y_offset,
-                               u_offset, v_offset, y_stride, u_stride, v_stride, crvf->Timestamp(),
-                               ddata->duration));
+            WrapTaskRefCounted(this, &VideoDecoder::DecodedTaskCallDecoded, img, sz.width,
+                               sz.height, crvf->Timestamp(), ddata->duration, ddata->epoch));
 
     } else {
         LOGZ << "   failure\n";
         fxcdm::get_platform_api()->runonmainthread(
-            WrapTask(dec_cb_, &GMPVideoDecoderCallback::Error, to_GMPErr(status)));
+            WrapTaskRefCounted(this, &VideoDecoder::ErrorTask, to_GMPErr(status)));
     }
 }
 
-void
-VideoDecoder::DecodedTaskCallDecoded(shared_ptr<vector<uint8_t>> raw, cdm::Size sz,
-                                     uint32_t y_offset, uint32_t u_offset, uint32_t v_offset,
-                                     uint32_t y_stride, uint32_t u_stride, uint32_t v_stride,
-                                     uint64_t timestamp, uint64_t duration)
+bool
+VideoDecoder::ParkIfKeyMissing(shared_ptr<DecodeData> ddata)
 {
-    LOGF << format("fxcdm::VideoDecoder::DecodedTaskCallDecoded raw.size()=%1%, sz={.width=%2%, "
-            ".height=%3%}, y_offset=%4%, u_offset=%5%, v_offset=%6%, y_stride=%7%, u_stride=%8%, "
-            "v_stride=%9%, timestamp=%10%, duration=%11%\n") % raw->size() % sz.width % sz.height %
-            y_offset % u_offset % v_offset % y_stride % u_stride % v_stride % timestamp % duration;
-
-    GMPVideoFrame *fxvf = nullptr;
-    auto err = host_api_->CreateFrame(kGMPI420VideoFrame, &fxvf);
-    if (GMP_FAILED(err)) {
-        LOGZ << format("   CreateFrame failed with code %1%\n") % err;
-        return;
+    if (!parked_frames_.empty() && parked_frames_.front()->epoch != epoch_) {
+        LOGF << "   frames parked before Reset(), dropping\n";
+        recovery_stats_.stale_frames_dropped += parked_frames_.size();
+        parked_frames_.clear();
     }
 
-    auto fxvf_i420 = static_cast<GMPVideoi420Frame *>(fxvf);
-    fxvf_i420->CreateFrame(y_stride * sz.height,     raw->data() + y_offset,
-                           u_stride * sz.height / 2, raw->data() + u_offset,
-                           v_stride * sz.height / 2, raw->data() + v_offset,
-                           sz.width, sz.height,
-                           y_stride, u_stride, v_stride);
+    if (parked_frames_.empty() && (ddata->key_id.empty() || keys::is_usable(ddata->key_id)))
+        return false;
 
-    fxvf_i420->SetTimestamp(timestamp);
-    fxvf_i420->SetDuration(duration);
+    if (parked_frames_.size() >= kMaxParkedSamples) {
+        LOGZ << "   too many frames are waiting for keys\n";
+        park_stats_.overflows += parked_frames_.size() + 1;
+        parked_frames_.clear();
+        fxcdm::get_platform_api()->runonmainthread(
+            WrapTaskRefCounted(this, &VideoDecoder::ErrorTask, GMPNoKeyErr));
+        return true;
+    }
 
-    dec_cb_->Decoded(fxvf_i420);
-    dec_cb_->InputDataExhausted();
-    LOGF << "   called dec_cb_->Decoded()\n";
+    LOGF << "   key is not usable yet, parking frame\n";
+    ddata->parked_since = std::chrono::steady_clock::now();
+    parked_frames_.push_back(ddata);
+    park_stats_.samples_parked ++;
+
+    return true;
 }
 
 void
-VideoDecoder::EnsureWorkerIsRunning()
+VideoDecoder::KeysBecameUsable(std::vector<keys::KeyId> key_ids)
 {
-    LOGF << "fxcdm::VideoDecoder::EnsureWorkerIsRunning (void)\n";
+    LOGF << format("fxcdm::VideoDecoder::KeysBecameUsable key_ids.size()=%1%\n") % key_ids.size();
 
     if (worker_thread_)
-        return;
+        worker_thread_->Post(WrapTaskRefCounted(this, &VideoDecoder::ResumeParkedTask));
+}
 
-    fxcdm::get_platform_api()->createthread(&worker_thread_);
-    if (!worker_thread_) {
+void
+VideoDecoder::ResumeParkedTask()
+{
+    LOGF << format("fxcdm::VideoDecoder::ResumeParkedTask parked_frames_.size()=%1%\n") %
+            parked_frames_.size();
+
+    std::deque<shared_ptr<DecodeData>> frames;
+    frames.swap(parked_frames_);
+
+    for (auto &ddata: frames) {
+        // first frame that still lacks its key stops the resume, the rest stay parked behind it
+        if (!parked_frames_.empty() ||
+            (!ddata->key_id.empty() && !keys::is_usable(ddata->key_id)))
+        {
+            parked_frames_.push_back(ddata);
+            continue;
+        }
+
+        const int64_t parked_ms = ms_since(ddata->parked_since);
+        park_stats_.samples_resumed ++;
+        park_stats_.park_time_ms += parked_ms;
+        park_stats_.max_park_time_ms = std::max(park_stats_.max_park_time_ms, parked_ms);
+
+        DecodeTask(ddata);
+    }
+}
+
+cdm::Size
+VideoDecoder::OutputSize(cdm::Size sz)
+{
+    if (max_output_width_ == 0 || max_output_height_ == 0)
+        return sz;
+
+    if (uint32_t(sz.width) <= max_output_width_ && uint32_t(sz.height) <= max_output_height_)
+        return sz;
+
+    // fit into the box, keeping aspect ratio
+    cdm::Size out;
+    if (uint64_t(sz.width) * max_output_height_ >= uint64_t(sz.height) * max_output_width_) {
+        out.width = max_output_width_;
+        out.height = uint64_t(sz.height) * max_output_width_ / sz.width;
+    } else {
+        out.height = max_output_height_;
+        out.width = uint64_t(sz.width) * max_output_height_ / sz.height;
+    }
+
+    out.width = std::max(out.width, 2);
+    out.height = std::max(out.height, 2);
+
+    return out;
+}
+
+bool
+VideoDecoder::IsTooLateToDecode(const DecodeData &ddata)
+{
+    // reference frames are needed to decode subsequent frames, so they are always decoded
+    if (ddata.is_reference || ddata.render_time_ms < 0)
+        return false;
+
+    GMPTimestamp now = 0;
+    if (GMP_FAILED(fxcdm::get_platform_api()->getcurrenttime(&now)))
+        return false;
+
+    if (std::abs(ddata.render_time_ms - now) > kRenderTimeSanityWindowMs)
+        return false;
+
+    int64_t expected_ready_ms = now + overload_stats_.decode_cost_us / 1000;
+    return expected_ready_ms > ddata.render_time_ms;
+}
+
+void
+VideoDecoder::UpdateDecodeCost(std::chrono::steady_clock::duration d)
+{
+    int64_t us = std::chrono::duration_cast<std::chrono::microseconds>(d).count();
+
+    // exponential moving average with 1/8 weight for the new sample
+    if (overload_stats_.decode_cost_us == 0)
+        overload_stats_.decode_cost_us = us;
+    else
+        overload_stats_.decode_cost_us += (us - overload_stats_.decode_cost_us) / 8;
+}
+
+void
+VideoDecoder::DecodedTaskCallDecoded(shared_ptr<planes::I420Image> img, int32_t decoded_width,
+                                     int32_t decoded_height, uint64_t timestamp,
+                                     uint64_t duration, uint32_t epoch)
+{
+    LOGF << format("fxcdm::VideoDecoder::DecodedTaskCallDecoded img={.width=%1%, .height=%2%, "
+            ".size=%3%}, decoded_width=%4%, decoded_height=%5%, timestamp=%6%, duration=%7%, "
+            "epoch=%8%\n") % img->width() % img->height() % img->size() % decoded_width %
+            decoded_height % timestamp % duration % epoch;
+
+    // also true after DecodingComplete(), when |dec_cb_| is gone
+    if (epoch != epoch_) {
+        LOGF << "   decoded before Reset(), dropping\n";
+        return;
+    }
+
+    GMPVideoFrame *fxvf = nullptr;
+    auto err = host_api_->CreateFrame(kGMPI420VideoFrame, &fxvf);
+    if (GMP_FAILED(err)) {
+        LOGZ << format("   CreateFrame failed with code %1%\n") % err;
+        return;
+    }
+
+    output_stats_.frames ++;
+    output_stats_.bytes_copied += img->size();
+    if (img->width() != decoded_width || img->height() != decoded_height)
+        output_stats_.frames_scaled ++;
+
+    auto fxvf_i420 = static_cast<GMPVideoi420Frame *>(fxvf);
+    fxvf_i420->CreateFrame(img->plane_size(planes::kY), img->plane(planes::kY),
+                           img->plane_size(planes::kU), img->plane(planes::kU),
+                           img->plane_size(planes::kV), img->plane(planes::kV),
+                           img->width(), img->height(),
+                           img->stride(planes::kY), img->stride(planes::kU),
+                           img->stride(planes::kV));
+
+    fxvf_i420->SetTimestamp(timestamp);
+    fxvf_i420->SetDuration(duration);
+
+    dec_cb_->Decoded(fxvf_i420);
+    dec_cb_->InputDataExhausted();
+    LOGF << "   called dec_cb_->Decoded()\n";
+
+    fxcdm::output_produced();
+}
+
+void
+VideoDecoder::InputDataExhaustedTask(uint32_t epoch)
+{
+    LOGF << format("fxcdm::VideoDecoder::InputDataExhaustedTask epoch=%1%\n") % epoch;
+
+    if (epoch == epoch_)
+        dec_cb_->InputDataExhausted();
+}
+
+void
+VideoDecoder::ErrorTask(GMPErr err)
+{
+    LOGF << format("fxcdm::VideoDecoder::ErrorTask err=%1%\n") % err;
+
+    // unlike frames, errors outlive Reset(): a failed decoder stays failed
+    if (!decoding_complete_)
+        dec_cb_->Error(err);
+}
+
+void
+VideoDecoder::EnsureWorkerIsRunning()
+{
+    LOGF << "fxcdm::VideoDecoder::EnsureWorkerIsRunning (void)\n";
+
+    if (worker_thread_)
+        return;
+
+    fxcdm::get_platform_api()->createthread(&worker_thread_);
+    if (!worker_thread_) {
         LOGZ << "   failed to create worker thread\n";
         dec_cb_->Error(GMPAllocErr);
     }
@@ -565,7 +1799,15 @@ void
 VideoDecoder::Reset()
 {
     LOGF << "fxcdm::VideoDecoder::Reset (void)\n";
-    crcdm::get()->ResetDecoder(cdm::kStreamTypeVideo);
+
+    // frames already queued to the worker (or held there) belong to the old position
+    epoch_ ++;
+    recovery_stats_.discontinuities ++;
+    wait_for_key_frame_ = true;
+
+    if (crcdm::get(cdm_id_))
+        crcdm::get(cdm_id_)->ResetDecoder(cdm::kStreamTypeVideo);
+
     dec_cb_->ResetComplete();
 }
 
@@ -573,9 +1815,12 @@ void
 VideoDecoder::Drain()
 {
     LOGF << "fxcdm::VideoDecoder::Drain (void)\n";
+
     // chrome interface doesn't have Drain() equivalent.
     // Since ResetDecoder() should also flush buffers, maybe it would suffice?
-    crcdm::get()->ResetDecoder(cdm::kStreamTypeVideo);
+    if (crcdm::get(cdm_id_))
+        crcdm::get(cdm_id_)->ResetDecoder(cdm::kStreamTypeVideo);
+
     dec_cb_->DrainComplete();
 }
 
@@ -584,12 +1829,42 @@ VideoDecoder::DecodingComplete()
 {
     LOGF << "fxcdm::VideoDecoder::DecodingComplete (void)\n";
 
+    {
+        std::lock_guard<std::mutex> lock(decoders_mutex);
+        video_decoders.erase(std::remove(video_decoders.begin(), video_decoders.end(), this),
+                             video_decoders.end());
+    }
+
+    // tasks already posted to main thread must not reach |dec_cb_| anymore
+    decoding_complete_ = true;
+    epoch_ ++;
+
     if (worker_thread_) {
         worker_thread_->Join();
         worker_thread_ = nullptr;
     }
 
-    crcdm::get()->DeinitializeDecoder(cdm::kStreamTypeVideo);
+    log_deferred_init_stats("video decoder", deferred_init_stats_);
+    log_park_stats("video decoder", park_stats_);
+    LOGS << format("video decoder: frames decoded: %1%, dropped as late: %2%, deadline misses: "
+            "%3%, average decode cost: %4% us\n") % overload_stats_.frames_decoded %
+            overload_stats_.frames_dropped % overload_stats_.deadline_misses %
+            overload_stats_.decode_cost_us;
+    LOGS << format("video decoder: frames delivered: %1% (%2% downscaled), bytes copied on main "
+            "thread: %3%\n") % output_stats_.frames % output_stats_.frames_scaled %
+            output_stats_.bytes_copied;
+    LOGS << format("video decoder: discontinuities: %1%, frames skipped while waiting for key "
+            "frame: %2%, stale frames dropped: %3%\n") % recovery_stats_.discontinuities %
+            recovery_stats_.frames_skipped % recovery_stats_.stale_frames_dropped;
+
+    // main instance's decoder is free for the next stream by the time it initializes it, as
+    // both happen on main thread
+    if (own_cdm_)
+        crcdm::destroy_decoder_instance(cdm_id_);
+    else if (crcdm::get(cdm_id_))
+        crcdm::get(cdm_id_)->DeinitializeDecoder(cdm::kStreamTypeVideo);
+
+    release_cdm_if_unused();
 
     Release();
 }
@@ -616,6 +1891,17 @@ AudioDecoder::InitDecode(const GMPAudioCodec &aCodecSettings,
 
     dec_cb_ = aCallback;
 
+    bool own_cdm;
+    const uint32_t cdm_id = choose_cdm_instance(audio_decoders, own_cdm);
+    {
+        std::lock_guard<std::mutex> lock(decoders_mutex);
+        cdm_id_ = cdm_id;
+        own_cdm_ = own_cdm;
+        audio_decoders.push_back(this);
+    }
+
+    LOGF << format("   CDM instance = %1%%2%\n") % cdm_id_ % (own_cdm_ ? " (own)" : "");
+
     cdm::AudioDecoderConfig aconf;
 
     switch (aCodecSettings.mCodecType) {
@@ -625,9 +1911,15 @@ AudioDecoder::InitDecode(const GMPAudioCodec &aCodecSettings,
         aconf.channel_count = aCodecSettings.mChannelCount;
         aconf.bits_per_channel = aCodecSettings.mBitsPerChannel;
         aconf.samples_per_second = aCodecSettings.mSamplesPerSecond;
-        aconf.extra_data = const_cast<uint8_t *>(aCodecSettings.mExtraData); // TODO: copy if called
-                                                                             // on another thread
-        aconf.extra_data_size = aCodecSettings.mExtraDataLen;
+        channels_ = aCodecSettings.mChannelCount;
+        rate_ = aCodecSettings.mSamplesPerSecond;
+
+        // initialization happens on the worker thread, while mExtraData is only guaranteed to
+        // be valid for the duration of this call
+        extra_data_.assign(aCodecSettings.mExtraData,
+                           aCodecSettings.mExtraData + aCodecSettings.mExtraDataLen);
+        aconf.extra_data = extra_data_.data();
+        aconf.extra_data_size = extra_data_.size();
 
         break;
 
@@ -638,34 +1930,568 @@ AudioDecoder::InitDecode(const GMPAudioCodec &aCodecSettings,
         break;
     }
 
-    // TODO: call on worker thread
-    cdm::Status status = crcdm::get()->InitializeAudioDecoder(aconf);
+    EnsureWorkerIsRunning();
+    if (!worker_thread_)
+        return;
+
+    worker_thread_->Post(WrapTaskRefCounted(this, &AudioDecoder::InitTask, aconf));
+}
+
+void
+AudioDecoder::InitTask(cdm::AudioDecoderConfig aconf)
+{
+    LOGF << "fxcdm::AudioDecoder::InitTask\n";
+
+    cdm::Status status = crcdm::get(cdm_id_) ? crcdm::get(cdm_id_)->InitializeAudioDecoder(aconf)
+                                             : cdm::kSessionError;
 
     LOGF << format("   InitializeAudioDecoder() returned %1%\n") % status;
+
+    switch (status) {
+    case cdm::kSuccess:
+        init_state_ = DecoderInitState::kInitialized;
+        break;
+
+    case cdm::kDeferredInitialization:
+        init_state_ = DecoderInitState::kDeferred;
+        deferred_since_ = std::chrono::steady_clock::now();
+        deferred_init_stats_.deferred_count ++;
+        fxcdm::get_platform_api()->runonmainthread(
+            WrapTaskRefCounted(this, &AudioDecoder::ArmDeferredInitTimeout));
+        break;
+
+    default:
+        LOGZ << format("   audio decoder initialization failed with status %1%\n") % status;
+        init_state_ = DecoderInitState::kFailed;
+        fxcdm::get_platform_api()->runonmainthread(
+            WrapTask(dec_cb_, &GMPAudioDecoderCallback::Error, to_GMPErr(status)));
+        break;
+    }
+}
+
+void
+AudioDecoder::ArmDeferredInitTimeout()
+{
+    LOGF << "fxcdm::AudioDecoder::ArmDeferredInitTimeout (void)\n";
+
+    GMPErr err = fxcdm::get_platform_api()->settimer(
+                    WrapTaskRefCounted(this, &AudioDecoder::DeferredInitTimedOut),
+                    kDeferredInitTimeoutMs);
+    if (GMP_FAILED(err))
+        LOGZ << format("   settimer failed with code %1%\n") % err;
+}
+
+void
+AudioDecoder::DeferredInitTimedOut()
+{
+    LOGF << "fxcdm::AudioDecoder::DeferredInitTimedOut (void)\n";
+
+    if (worker_thread_)
+        worker_thread_->Post(WrapTaskRefCounted(this, &AudioDecoder::DeferredInitTimeoutTask));
+}
+
+void
+AudioDecoder::DeferredInitTimeoutTask()
+{
+    LOGF << "fxcdm::AudioDecoder::DeferredInitTimeoutTask (void)\n";
+
+    if (init_state_ != DecoderInitState::kDeferred)
+        return;
+
+    LOGZ << "   deferred audio decoder initialization timed out\n";
+
+    init_state_ = DecoderInitState::kFailed;
+    deferred_init_stats_.timeout_count ++;
+    deferred_init_stats_.wait_time_ms += ms_since(deferred_since_);
+    deferred_init_stats_.frames_dropped += held_samples_.size();
+    held_samples_.clear();
+
+    fxcdm::get_platform_api()->runonmainthread(
+        WrapTask(dec_cb_, &GMPAudioDecoderCallback::Error, GMPAbortedErr));
+}
+
+void
+AudioDecoder::DeferredInitializationDone(cdm::Status decoder_status)
+{
+    LOGF << format("fxcdm::AudioDecoder::DeferredInitializationDone decoder_status=%1%\n") %
+            decoder_status;
+
+    if (worker_thread_) {
+        worker_thread_->Post(WrapTaskRefCounted(this, &AudioDecoder::DeferredInitDoneTask,
+                                                decoder_status));
+    }
+}
+
+void
+AudioDecoder::DeferredInitDoneTask(cdm::Status decoder_status)
+{
+    LOGF << format("fxcdm::AudioDecoder::DeferredInitDoneTask decoder_status=%1%\n") %
+            decoder_status;
+
+    if (init_state_ != DecoderInitState::kDeferred) {
+        LOGF << "   decoder is not waiting for deferred initialization, ignoring\n";
+        return;
+    }
+
+    deferred_init_stats_.wait_time_ms += ms_since(deferred_since_);
+
+    if (decoder_status != cdm::kSuccess) {
+        LOGZ << format("   deferred audio decoder initialization failed with status %1%\n") %
+                decoder_status;
+        init_state_ = DecoderInitState::kFailed;
+        deferred_init_stats_.failed_count ++;
+        deferred_init_stats_.frames_dropped += held_samples_.size();
+        held_samples_.clear();
+
+        fxcdm::get_platform_api()->runonmainthread(
+            WrapTask(dec_cb_, &GMPAudioDecoderCallback::Error, to_GMPErr(decoder_status)));
+        return;
+    }
+
+    init_state_ = DecoderInitState::kInitialized;
+    deferred_init_stats_.completed_count ++;
+
+    LOGF << format("   resuming %1% held samples\n") % held_samples_.size();
+
+    DecodeBatch batch;
+    batch.swap(held_samples_);
+    deferred_init_stats_.frames_resumed += batch.size();
+
+    DecodeSamples(batch);
+}
+
+void
+AudioDecoder::EnsureWorkerIsRunning()
+{
+    LOGF << "fxcdm::AudioDecoder::EnsureWorkerIsRunning (void)\n";
+
+    if (worker_thread_)
+        return;
+
+    fxcdm::get_platform_api()->createthread(&worker_thread_);
+    if (!worker_thread_) {
+        LOGZ << "   failed to create worker thread\n";
+        dec_cb_->Error(GMPAllocErr);
+    }
 }
 
 void
 AudioDecoder::Decode(GMPAudioSamples *aEncodedSamples)
 {
-    LOGZ << format("fxcdm::AudioDecoder::Decode aEncodedSamples=%1%\n") % aEncodedSamples;
+    LOGF << format("fxcdm::AudioDecoder::Decode aEncodedSamples=%1%\n") % aEncodedSamples;
+    LOGF << format("   data = %1%, data_size = %2%, timestamp = %3%\n") %
+            static_cast<const void *>(aEncodedSamples->Buffer()) % aEncodedSamples->Size() %
+            aEncodedSamples->TimeStamp();
+
+    if (!worker_thread_) {
+        aEncodedSamples->Destroy();
+        return;
+    }
+
+    auto ddata = make_shared<DecodeData>();
+
+    ddata->buf.assign(aEncodedSamples->Buffer(),
+                      aEncodedSamples->Buffer() + aEncodedSamples->Size());
+    ddata->timestamp = aEncodedSamples->TimeStamp();
+    ddata->epoch = epoch_;
+
+    const GMPEncryptedBufferMetadata *metadata = aEncodedSamples->GetDecryptionData();
+    if (!is_clear_sample(metadata)) {
+        LOGF << format("   key = %1%\n") % to_hex_string(metadata->KeyId(), metadata->KeyIdSize());
+        LOGF << format("   IV = %1%\n") % to_hex_string(metadata->IV(), metadata->IVSize());
+        LOGF << format("   subsamples (clear, cipher) = %1%\n") %
+            subsamples_to_string(metadata->NumSubsamples(), metadata->ClearBytes(),
+                                 metadata->CipherBytes());
+
+        ddata->key_id.assign(metadata->KeyId(), metadata->KeyId() + metadata->KeyIdSize());
+        ddata->iv.assign(metadata->IV(), metadata->IV() + metadata->IVSize());
+
+        ddata->subsamples.reserve(metadata->NumSubsamples());
+        for (uint32_t k = 0; k < metadata->NumSubsamples(); k ++)
+            ddata->subsamples.emplace_back(metadata->ClearBytes()[k], metadata->CipherBytes()[k]);
+    }
+
+    aEncodedSamples->Destroy();
+    stats_.samples_in ++;
+
+    bool post_task;
+    {
+        std::lock_guard<std::mutex> lock(pending_mutex_);
+        pending_.push_back(ddata);
+        post_task = !decode_task_posted_;
+        decode_task_posted_ = true;
+    }
+
+    if (post_task)
+        worker_thread_->Post(WrapTaskRefCounted(this, &AudioDecoder::DecodeTask));
+}
+
+void
+AudioDecoder::DecodeTask()
+{
+    LOGF << "fxcdm::AudioDecoder::DecodeTask (void)\n";
+
+    DecodeBatch batch;
+    {
+        std::lock_guard<std::mutex> lock(pending_mutex_);
+        batch.swap(pending_);
+        decode_task_posted_ = false;
+    }
+
+    switch (init_state_) {
+    case DecoderInitState::kInitialized:
+        break;
+
+    case DecoderInitState::kDeferred:
+        LOGF << format("   decoder initialization is deferred, holding %1% samples\n") %
+                batch.size();
+        held_samples_.insert(held_samples_.end(), batch.begin(), batch.end());
+        deferred_init_stats_.frames_held += batch.size();
+        return;
+
+    default:
+        LOGF << "   decoder is not initialized, dropping samples\n";
+        return;
+    }
+
+    DecodeSamples(batch);
+}
+
+void
+AudioDecoder::DecodeSamples(DecodeBatch &batch)
+{
+    LOGF << format("fxcdm::AudioDecoder::DecodeSamples batch.size()=%1%\n") % batch.size();
+
+    if (batch.empty())
+        return;
+
+    stats_.batches ++;
+    stats_.max_batch = std::max<uint32_t>(stats_.max_batch, batch.size());
+
+    for (auto &ddata: batch) {
+        if (ParkIfKeyMissing(ddata))
+            continue;
+        if (!DecodeOne(*ddata))
+            return;
+    }
+
+    // one notification per batch: decoded samples are already queued to main thread before it
+    fxcdm::get_platform_api()->runonmainthread(
+        WrapTask(dec_cb_, &GMPAudioDecoderCallback::InputDataExhausted));
+}
+
+bool
+AudioDecoder::DecodeOne(const DecodeData &ddata)
+{
+    if (ddata.epoch != epoch_) {
+        LOGF << "   samples were queued before Reset(), dropping\n";
+        stats_.stale_dropped ++;
+        return true;
+    }
+
+    cdm::InputBuffer inp_buf;
+
+    inp_buf.data =        ddata.buf.data();
+    inp_buf.data_size =   ddata.buf.size();
+
+    inp_buf.key_id =      ddata.key_id.data();
+    inp_buf.key_id_size = ddata.key_id.size();
+
+    inp_buf.iv =          ddata.iv.data();
+    inp_buf.iv_size =     ddata.iv.size();
+
+    inp_buf.subsamples =     ddata.subsamples.data();
+    inp_buf.num_subsamples = ddata.subsamples.size();
+
+    inp_buf.timestamp = ddata.timestamp;
+
+    crcdm::AudioFrames frames;
+    std::vector<uint8_t> clear;
+    cdm::Status status = own_cdm_ ? decrypt_on_main_instance(inp_buf, clear) : cdm::kSuccess;
+    if (status == cdm::kSuccess) {
+        status = crcdm::get(cdm_id_) ? crcdm::get(cdm_id_)->DecryptAndDecodeSamples(inp_buf,
+                                                                                   &frames)
+                                     : cdm::kDecodeError;
+    }
+    LOGF << format("   DecryptAndDecodeSamples returned %1%\n") % status;
+
+    if (status == cdm::kNeedMoreData)
+        return true;
+
+    if (status != cdm::kSuccess) {
+        LOGZ << format("   audio decoding failed with status %1%\n") % status;
+        fxcdm::get_platform_api()->runonmainthread(
+            WrapTask(dec_cb_, &GMPAudioDecoderCallback::Error, to_GMPErr(status)));
+        return false;
+    }
+
+    if (frames.FrameBuffer()) {
+        // CDM buffer is handed to main thread as is; samples are converted right into
+        // GMPAudioSamples there
+        shared_ptr<cdm::Buffer> buf(frames.FrameBuffer(), [](cdm::Buffer *b) { b->Destroy(); });
+        fxcdm::get_platform_api()->runonmainthread(
+            WrapTaskRefCounted(this, &AudioDecoder::DecodedTaskCallDecoded, buf,
+                               frames.Format(), ddata.epoch));
+    }
+
+    return true;
+}
+
+bool
+AudioDecoder::ParkIfKeyMissing(shared_ptr<DecodeData> ddata)
+{
+    if (!parked_samples_.empty() && parked_samples_.front()->epoch != epoch_) {
+        LOGF << "   samples parked before Reset(), dropping\n";
+        stats_.stale_dropped += parked_samples_.size();
+        parked_samples_.clear();
+    }
+
+    if (parked_samples_.empty() && (ddata->key_id.empty() || keys::is_usable(ddata->key_id)))
+        return false;
+
+    if (parked_samples_.size() >= kMaxParkedSamples) {
+        LOGZ << "   too many samples are waiting for keys\n";
+        park_stats_.overflows += parked_samples_.size() + 1;
+        parked_samples_.clear();
+        fxcdm::get_platform_api()->runonmainthread(
+            WrapTask(dec_cb_, &GMPAudioDecoderCallback::Error, GMPNoKeyErr));
+        return true;
+    }
+
+    LOGF << "   key is not usable yet, parking sample\n";
+    ddata->parked_since = std::chrono::steady_clock::now();
+    parked_samples_.push_back(ddata);
+    park_stats_.samples_parked ++;
+
+    return true;
+}
+
+void
+AudioDecoder::KeysBecameUsable(std::vector<keys::KeyId> key_ids)
+{
+    LOGF << format("fxcdm::AudioDecoder::KeysBecameUsable key_ids.size()=%1%\n") % key_ids.size();
+
+    if (worker_thread_)
+        worker_thread_->Post(WrapTaskRefCounted(this, &AudioDecoder::ResumeParkedTask));
+}
+
+void
+AudioDecoder::ResumeParkedTask()
+{
+    LOGF << format("fxcdm::AudioDecoder::ResumeParkedTask parked_samples_.size()=%1%\n") %
+            parked_samples_.size();
+
+    // resume the longest prefix that has keys now, the rest stays parked in order
+    DecodeBatch batch;
+    while (!parked_samples_.empty()) {
+        auto &ddata = parked_samples_.front();
+        if (!ddata->key_id.empty() && !keys::is_usable(ddata->key_id))
+            break;
+
+        const int64_t parked_ms = ms_since(ddata->parked_since);
+        park_stats_.samples_resumed ++;
+        park_stats_.park_time_ms += parked_ms;
+        park_stats_.max_park_time_ms = std::max(park_stats_.max_park_time_ms, parked_ms);
+
+        batch.push_back(ddata);
+        parked_samples_.pop_front();
+    }
+
+    if (batch.empty())
+        return;
+
+    // resumed samples go to CDM directly: DecodeSamples() would park them again, behind those
+    // that arrived after them
+    stats_.batches ++;
+    stats_.max_batch = std::max<uint32_t>(stats_.max_batch, batch.size());
+
+    for (auto &ddata: batch) {
+        if (!DecodeOne(*ddata))
+            return;
+    }
+
+    fxcdm::get_platform_api()->runonmainthread(
+        WrapTask(dec_cb_, &GMPAudioDecoderCallback::InputDataExhausted));
+}
+
+void
+AudioDecoder::DecodedTaskCallDecoded(shared_ptr<cdm::Buffer> buf, cdm::AudioFormat fmt,
+                                     uint32_t epoch)
+{
+    LOGF << format("fxcdm::AudioDecoder::DecodedTaskCallDecoded buf=%1%, fmt=%2%, epoch=%3%\n") %
+            buf.get() % fmt % epoch;
+
+    if (epoch != epoch_) {
+        LOGF << "   decoded before Reset(), dropping\n";
+        return;
+    }
+
+    const uint32_t bytes_per_frame = audio::bytes_per_sample(fmt) * channels_;
+    if (bytes_per_frame == 0) {
+        LOGZ << format("   unsupported audio format %1%\n") % fmt;
+        dec_cb_->Error(GMPDecodeErr);
+        return;
+    }
+
+    // CDM serializes decoded audio as a sequence of (int64 timestamp, int64 size, data) records
+    const uint8_t *ptr = buf->Data();
+    const uint8_t *end = ptr + buf->Size();
+
+    while (end - ptr >= 2 * int64_t(sizeof(int64_t))) {
+        int64_t timestamp;
+        int64_t size;
+        memcpy(&timestamp, ptr, sizeof(timestamp));
+        memcpy(&size, ptr + sizeof(timestamp), sizeof(size));
+        ptr += sizeof(timestamp) + sizeof(size);
+
+        if (size < 0 || size > end - ptr) {
+            LOGZ << "   malformed audio frame buffer\n";
+            break;
+        }
+
+        const uint32_t frame_count = size / bytes_per_frame;
+
+        GMPAudioSamples *samples = nullptr;
+        GMPErr err = host_api_->CreateSamples(kGMPAudioIS16Samples, &samples);
+        if (GMP_FAILED(err)) {
+            LOGZ << format("   CreateSamples failed with code %1%\n") % err;
+            return;
+        }
+
+        err = samples->SetBufferSize(frame_count * channels_ * sizeof(int16_t));
+        if (GMP_FAILED(err)) {
+            LOGZ << format("   SetBufferSize failed with code %1%\n") % err;
+            samples->Destroy();
+            return;
+        }
+
+        audio::convert_to_s16(fmt, ptr, channels_, frame_count,
+                              reinterpret_cast<int16_t *>(samples->Buffer()));
+
+        samples->SetTimeStamp(timestamp);
+        samples->SetChannels(channels_);
+        samples->SetRate(rate_);
+
+        stats_.samples_out ++;
+        dec_cb_->Decoded(samples);
+
+        ptr += size;
+    }
+}
+
+void
+AudioDecoder::ResetTask()
+{
+    LOGF << "fxcdm::AudioDecoder::ResetTask (void)\n";
+
+    if (crcdm::get(cdm_id_))
+        crcdm::get(cdm_id_)->ResetDecoder(cdm::kStreamTypeAudio);
+
+    fxcdm::get_platform_api()->runonmainthread(
+        WrapTask(dec_cb_, &GMPAudioDecoderCallback::ResetComplete));
+}
+
+void
+AudioDecoder::DrainTask()
+{
+    LOGF << "fxcdm::AudioDecoder::DrainTask (void)\n";
+
+    if (init_state_ == DecoderInitState::kInitialized) {
+        // empty input makes CDM flush its internal buffers, one chunk at a time
+        const uint32_t epoch = epoch_;
+
+        for (int k = 0; k < 16; k ++) {
+            cdm::InputBuffer inp_buf;
+            crcdm::AudioFrames frames;
+
+            cdm::Status status = crcdm::get(cdm_id_)
+                                    ? crcdm::get(cdm_id_)->DecryptAndDecodeSamples(inp_buf,
+                                                                                   &frames)
+                                    : cdm::kDecodeError;
+            if (status != cdm::kSuccess || !frames.FrameBuffer())
+                break;
+
+            if (frames.FrameBuffer()->Size() == 0) {
+                frames.FrameBuffer()->Destroy();
+                break;
+            }
+
+            shared_ptr<cdm::Buffer> buf(frames.FrameBuffer(),
+                                        [](cdm::Buffer *b) { b->Destroy(); });
+            fxcdm::get_platform_api()->runonmainthread(
+                WrapTaskRefCounted(this, &AudioDecoder::DecodedTaskCallDecoded, buf,
+                                   frames.Format(), epoch));
+        }
+    }
+
+    fxcdm::get_platform_api()->runonmainthread(
+        WrapTask(dec_cb_, &GMPAudioDecoderCallback::DrainComplete));
 }
 
 void
 AudioDecoder::Reset()
 {
-    LOGZ << "fxcdm::AudioDecoder::Reset (void)\n";
+    LOGF << "fxcdm::AudioDecoder::Reset (void)\n";
+
+    // samples already queued to the worker (or decoded, but not delivered yet) belong to the old
+    // position
+    epoch_ ++;
+
+    if (!worker_thread_) {
+        dec_cb_->ResetComplete();
+        return;
+    }
+
+    worker_thread_->Post(WrapTaskRefCounted(this, &AudioDecoder::ResetTask));
 }
 
 void
 AudioDecoder::Drain()
 {
-    LOGZ << "fxcdm::AudioDecoder::Drain (void)\n";
+    LOGF << "fxcdm::AudioDecoder::Drain (void)\n";
+
+    if (!worker_thread_) {
+        dec_cb_->DrainComplete();
+        return;
+    }
+
+    // queued after any pending DecodeTask, so all input is decoded by the time it runs
+    worker_thread_->Post(WrapTaskRefCounted(this, &AudioDecoder::DrainTask));
 }
 
 void
 AudioDecoder::DecodingComplete()
 {
-    LOGZ << "fxcdm::AudioDecoder::DecodingComplete (void)\n";
+    LOGF << "fxcdm::AudioDecoder::DecodingComplete (void)\n";
+
+    {
+        std::lock_guard<std::mutex> lock(decoders_mutex);
+        audio_decoders.erase(std::remove(audio_decoders.begin(), audio_decoders.end(), this),
+                             audio_decoders.end());
+    }
+
+    epoch_ ++;
+
+    if (worker_thread_) {
+        worker_thread_->Join();
+        worker_thread_ = nullptr;
+    }
+
+    log_deferred_init_stats("audio decoder", deferred_init_stats_);
+    log_park_stats("audio decoder", park_stats_);
+    LOGS << format("audio decoder: samples in: %1%, out: %2%, batches: %3% (max %4%), stale "
+            "samples dropped: %5%\n") % stats_.samples_in % stats_.samples_out % stats_.batches %
+            stats_.max_batch % stats_.stale_dropped;
+
+    // see VideoDecoder::DecodingComplete()
+    if (own_cdm_)
+        crcdm::destroy_decoder_instance(cdm_id_);
+    else if (crcdm::get(cdm_id_))
+        crcdm::get(cdm_id_)->DeinitializeDecoder(cdm::kStreamTypeAudio);
+
+    release_cdm_if_unused();
+
+    Release();
 }
 
 
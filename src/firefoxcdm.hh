@@ -32,11 +32,19 @@
 #include <api/gmp/gmp-audio-host.h>
 #include <api/crcdm/content_decryption_module.h>
 #include <lib/RefCounted.h>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <map>
 #include <memory>
+#include <mutex>
 #include <sstream>
+#include <utility>
 #include <vector>
 #include <boost/format.hpp>
 #include "chromecdm.hh"
+#include "keys.hh"
+#include "planes.hh"
 
 
 namespace fxcdm {
@@ -50,6 +58,140 @@ get_platform_api();
 GMPDecryptorCallback *
 host();
 
+// Tells whether sample can skip decryption: it has no key id, or all its subsamples are clear.
+bool
+is_clear_sample(const GMPEncryptedBufferMetadata *metadata);
+
+// Called by CDM instance |instance_id| (possibly on its own thread) after it returned
+// kDeferredInitialization from InitializeAudioDecoder() or InitializeVideoDecoder().
+void
+deferred_initialization_done(uint32_t instance_id, cdm::StreamType stream_type,
+                             cdm::Status decoder_status);
+
+// Called after |key_ids| became usable, to resume samples that were parked waiting for them.
+void
+keys_became_usable(const std::vector<keys::KeyId> &key_ids);
+
+// Lets CDM instance go once decryptor and both decoders are done with it. Main thread only.
+void
+release_cdm_if_unused();
+
+// Called on main thread after CDM closed |session_id|.
+void
+session_closed(const std::string &session_id);
+
+typedef std::vector<std::pair<keys::KeyId, GMPMediaKeyStatus>> KeyStatuses;
+
+// Called on main thread with key status transitions CDM reported for |session_id|, after they
+// were passed to Firefox for the session itself.
+void
+session_keys_changed(const std::string &session_id, const KeyStatuses &statuses);
+
+// Called on main thread after expiration time of |session_id| was passed to Firefox.
+void
+session_expiration_changed(const std::string &session_id, int64_t expiry_ms);
+
+// Called on main thread each time a decoded frame or a decrypted sample is handed to Firefox.
+// The first one ends time-to-first-frame measurement.
+void
+output_produced();
+
+enum class DecoderInitState {
+    kNotInitialized,
+    kDeferred,
+    kInitialized,
+    kFailed,
+};
+
+struct DeferredInitStats {
+    uint32_t    deferred_count = 0;
+    uint32_t    completed_count = 0;
+    uint32_t    failed_count = 0;
+    uint32_t    timeout_count = 0;
+    uint32_t    frames_held = 0;
+    uint32_t    frames_resumed = 0;
+    uint32_t    frames_dropped = 0;
+    int64_t     wait_time_ms = 0;
+};
+
+// Time limit for CDM to call OnDeferredInitializationDone().
+const int64_t kDeferredInitTimeoutMs = 10000;
+
+struct OverloadStats {
+    uint32_t    frames_decoded = 0;
+    uint32_t    frames_dropped = 0;     // non-reference frames skipped as too late
+    uint32_t    deadline_misses = 0;    // frames delivered after their render time
+    int64_t     decode_cost_us = 0;     // moving average of DecryptAndDecodeFrame() duration
+};
+
+struct RecoveryStats {
+    uint32_t    discontinuities = 0;        // Reset() calls and Decode() with aMissingFrames
+    uint32_t    frames_skipped = 0;         // non-key frames dropped while waiting for key frame
+    uint32_t    stale_frames_dropped = 0;   // frames queued before Reset()
+};
+
+struct OutputStats {
+    uint32_t    frames = 0;
+    uint32_t    frames_scaled = 0;
+    uint64_t    bytes_copied = 0;       // bytes passed to GMPVideoi420Frame::CreateFrame
+};
+
+struct ParkStats {
+    uint32_t    samples_parked = 0;
+    uint32_t    samples_resumed = 0;
+    uint32_t    overflows = 0;          // samples that didn't fit and failed with no key error
+    int64_t     park_time_ms = 0;       // total time resumed samples spent waiting
+    int64_t     max_park_time_ms = 0;
+};
+
+// Samples waiting for their keys, per decryptor or decoder. Anything beyond that fails as before.
+const size_t kMaxParkedSamples = 256;
+
+// Decrypt batch sizes are counted in buckets: 1, 2, 3-4, 5-8, 9-16, 17 and more.
+const int kBatchSizeBuckets = 6;
+
+struct BatchStats {
+    uint32_t    batches[kBatchSizeBuckets] = {};
+    uint32_t    samples[kBatchSizeBuckets] = {};
+    int64_t     cdm_time_us[kBatchSizeBuckets] = {};    // spent in CDM's Decrypt()
+};
+
+struct DecryptStats {
+    uint32_t    samples = 0;
+    uint32_t    clear_samples = 0;      // completed without involving CDM
+    uint32_t    failed = 0;             // returned to host with an error
+    uint32_t    max_queue_depth = 0;
+    uint64_t    queue_depth_sum = 0;    // sampled at each Decrypt() call
+    int64_t     main_thread_us = 0;     // spent in Decrypt() and in completion tasks
+};
+
+struct AudioStats {
+    uint32_t    samples_in = 0;         // GMPAudioSamples passed to Decode()
+    uint32_t    batches = 0;            // worker tasks that called DecryptAndDecodeSamples()
+    uint32_t    max_batch = 0;
+    uint32_t    samples_out = 0;        // GMPAudioSamples passed to Decoded()
+    uint32_t    stale_dropped = 0;      // samples queued before Reset()
+};
+
+// Time from the first session request to the first frame handed to Firefox. Loaded persistent
+// sessions have their license in storage and skip the license server round trip.
+struct FirstFrameTiming {
+    bool        session_requested = false;
+    bool        session_loaded = false;     // first request was LoadSession()
+    bool        first_frame_seen = false;
+    std::chrono::steady_clock::time_point requested_at;
+};
+
+struct LicenseRequestStats {
+    uint32_t    sessions_created = 0;
+    uint32_t    with_key_ids = 0;           // cenc init data had Widevine key ids
+    uint32_t    suppressed = 0;             // served by an alias of an open session
+};
+
+// Render times further than that from current time are considered to be in some other time base,
+// and are ignored.
+const int64_t kRenderTimeSanityWindowMs = 10000;
+
 class Module final : public GMPDecryptor, public RefCounted
 {
 public:
@@ -88,6 +230,105 @@ public:
 
     virtual void
     DecryptingComplete() override;
+
+    void
+    KeysBecameUsable(std::vector<keys::KeyId> key_ids);
+
+    void
+    OutputProduced();
+
+    void
+    SessionClosed(const std::string &session_id);
+
+    void
+    SessionKeysChanged(const std::string &session_id, const KeyStatuses &statuses);
+
+    void
+    SessionExpirationChanged(const std::string &session_id, int64_t expiry_ms);
+
+private:
+    // Rejects |promise_id| if there is no CDM instance to pass the call to. Returns true if it
+    // did.
+    bool
+    RejectIfNoCdm(uint32_t promise_id);
+
+    void
+    SessionRequested(bool loaded);
+
+    // Resolves CreateSession() with an alias of an open session that already has all of
+    // |key_ids| usable. Returns false if there is no such session.
+    bool
+    CreateAliasSession(uint32_t create_session_token, uint32_t promise_id,
+                       const std::vector<keys::KeyId> &key_ids);
+
+    // Everything worker needs to decrypt a sample. Metadata is copied, since it's not guaranteed
+    // to outlive the Decrypt() call.
+    struct DecryptJob {
+        GMPBuffer                       *buffer = nullptr;
+        std::vector<uint8_t>             key_id;
+        std::vector<uint8_t>             iv;
+        std::vector<cdm::SubsampleEntry> subsamples;
+        int64_t                          timestamp = 0;
+        bool                             clear = false;
+        GMPErr                           result = GMPNoErr;
+        std::chrono::steady_clock::time_point parked_since;
+    };
+
+    typedef std::vector<std::shared_ptr<DecryptJob>> DecryptBatch;
+
+    void
+    DecryptBatchTask();
+
+    void
+    ProcessBatch(DecryptBatch &batch);
+
+    void
+    DecryptJobWithCDM(DecryptJob &job);
+
+    // Tells whether job can be completed now: it's clear, or its key is usable.
+    bool
+    IsReady(const DecryptJob &job);
+
+    bool
+    ParkIfKeyMissing(std::shared_ptr<DecryptJob> job);
+
+    void
+    ResumeParkedTask();
+
+    void
+    DecryptedBatchTask(DecryptBatch batch);
+
+    // jobs are processed by a single worker and completed in the order they were submitted
+    GMPThread      *decrypt_thread_ = nullptr;
+
+    // jobs waiting for the worker; Decrypt() posts a DecryptBatchTask only when there is none
+    // pending already, so a burst of samples is handled in one worker turn
+    std::mutex      pending_mutex_;
+    DecryptBatch    pending_jobs_;
+    bool            decrypt_task_posted_ = false;
+
+    // accessed on decrypt thread only (or on main thread, once it's joined)
+    std::deque<std::shared_ptr<DecryptJob>> parked_jobs_;   // in submission order
+    ParkStats       park_stats_;
+    BatchStats      batch_stats_;
+
+    // accessed on main thread only
+    bool            decrypting_complete_ = false;
+    uint32_t        jobs_in_flight_ = 0;        // parked ones included, clear samples queue
+                                                // behind them
+    DecryptStats    decrypt_stats_;
+    FirstFrameTiming first_frame_timing_;
+
+    // Session created in place of a license request, sharing keys of an open CDM session. It
+    // mirrors key statuses and expiration of that session, and is closed together with it.
+    struct AliasSession {
+        std::string             source_session_id;
+        std::vector<keys::KeyId> key_ids;
+    };
+
+    std::map<std::string, AliasSession> alias_sessions_;   // by alias id
+    uint32_t        next_alias_id_ = 1;
+    LicenseRequestStats license_request_stats_;
 };
 
 class ModuleAsyncShutdown final : public GMPAsyncShutdown
@@ -131,6 +372,15 @@ public:
     virtual void
     DecodingComplete() override;
 
+    void
+    DeferredInitializationDone(cdm::Status decoder_status);
+
+    void
+    KeysBecameUsable(std::vector<keys::KeyId> key_ids);
+
+    uint32_t
+    CdmInstanceId() const { return cdm_id_; }
+
 private:
 
     struct DecodeData {
@@ -139,6 +389,9 @@ private:
             , duration(0)
             , timestamp(0)
             , is_key_frame(false)
+            , is_reference(true)
+            , render_time_ms(-1)
+            , epoch(0)
         {}
 
         GMPBufferType        buf_type;
@@ -146,22 +399,63 @@ private:
         uint64_t             duration;
         uint64_t             timestamp;
         bool                 is_key_frame;
+        bool                 is_reference;
+        int64_t              render_time_ms;
+        uint32_t             epoch;
         std::vector<uint8_t> key_id;
         std::vector<uint8_t> iv;
         std::vector<cdm::SubsampleEntry> subsamples;
+        std::chrono::steady_clock::time_point parked_since;
     };
 
     void
     EnsureWorkerIsRunning();
 
+    void
+    InitTask(cdm::VideoDecoderConfig video_decoder_config);
+
+    bool
+    ParkIfKeyMissing(std::shared_ptr<DecodeData> ddata);
+
+    void
+    ResumeParkedTask();
+
+    void
+    ArmDeferredInitTimeout();
+
+    void
+    DeferredInitTimedOut();
+
+    void
+    DeferredInitTimeoutTask();
+
+    void
+    DeferredInitDoneTask(cdm::Status decoder_status);
+
     void
     DecodeTask(std::shared_ptr<DecodeData> ddata);
 
+    bool
+    IsTooLateToDecode(const DecodeData &ddata);
+
+    void
+    UpdateDecodeCost(std::chrono::steady_clock::duration d);
+
     void
-    DecodedTaskCallDecoded(std::shared_ptr<std::vector<uint8_t>> raw, cdm::Size sz,
-                           uint32_t y_offset, uint32_t u_offset, uint32_t v_offset,
-                           uint32_t y_stride, uint32_t u_stride, uint32_t v_stride,
-                           uint64_t timestamp, uint64_t duration);
+    DecodedTaskCallDecoded(std::shared_ptr<planes::I420Image> img, int32_t decoded_width,
+                           int32_t decoded_height, uint64_t timestamp, uint64_t duration,
+                           uint32_t epoch);
+
+    // Worker's callbacks to |dec_cb_|, run on main thread. Dropped once DecodingComplete() has
+    // been called; InputDataExhaustedTask() is dropped after Reset() too.
+    void
+    InputDataExhaustedTask(uint32_t epoch);
+
+    void
+    ErrorTask(GMPErr err);
+
+    cdm::Size
+    OutputSize(cdm::Size sz);
 
 
     GMPVideoDecoderCallback *dec_cb_ = nullptr;
@@ -170,6 +464,40 @@ private:
     GMPThread               *worker_thread_ = nullptr;
 
     std::vector<uint8_t>     extra_data_annexb_;
+
+    // CDM instance decoding this stream; unless it's the main one, samples are decrypted by
+    // the main instance first. Set in InitDecode().
+    uint32_t                 cdm_id_ = 0;
+    bool                     own_cdm_ = false;
+
+    cdm::VideoDecoderConfig::VideoCodec codec_ = cdm::VideoDecoderConfig::kUnknownVideoCodec;
+
+    // decoded frames larger than that are downscaled; zero means no limit
+    uint32_t                 max_output_width_ = 0;
+    uint32_t                 max_output_height_ = 0;
+
+    // incremented by Reset() and DecodingComplete(); frames decoded on worker are tagged with it
+    std::atomic<uint32_t>    epoch_{0};
+
+    // accessed on main thread only
+    bool                     wait_for_key_frame_ = true;
+    bool                     decoding_complete_ = false;
+
+    // |stale_frames_dropped| is updated on worker thread, other fields on main thread
+    RecoveryStats            recovery_stats_;
+    OutputStats              output_stats_;
+
+    // accessed on worker thread only
+    DecoderInitState         init_state_ = DecoderInitState::kNotInitialized;
+    std::chrono::steady_clock::time_point deferred_since_;
+    std::deque<std::shared_ptr<DecodeData>> held_frames_;
+    DeferredInitStats        deferred_init_stats_;
+    OverloadStats            overload_stats_;
+
+    // frames waiting for a key, in decode order; once one frame is parked, all that follow it
+    // are parked too
+    std::deque<std::shared_ptr<DecodeData>> parked_frames_;
+    ParkStats                park_stats_;
 };
 
 
@@ -195,9 +523,108 @@ public:
     virtual void
     DecodingComplete() override;
 
+    void
+    DeferredInitializationDone(cdm::Status decoder_status);
+
+    void
+    KeysBecameUsable(std::vector<keys::KeyId> key_ids);
+
+    uint32_t
+    CdmInstanceId() const { return cdm_id_; }
+
 private:
+
+    struct DecodeData {
+        std::vector<uint8_t> buf;
+        uint64_t             timestamp = 0;
+        uint32_t             epoch = 0;
+        std::vector<uint8_t> key_id;
+        std::vector<uint8_t> iv;
+        std::vector<cdm::SubsampleEntry> subsamples;
+        std::chrono::steady_clock::time_point parked_since;
+    };
+
+    typedef std::vector<std::shared_ptr<DecodeData>> DecodeBatch;
+
+    void
+    EnsureWorkerIsRunning();
+
+    void
+    InitTask(cdm::AudioDecoderConfig aconf);
+
+    void
+    DecodeTask();
+
+    void
+    DecodeSamples(DecodeBatch &batch);
+
+    bool
+    DecodeOne(const DecodeData &ddata);
+
+    bool
+    ParkIfKeyMissing(std::shared_ptr<DecodeData> ddata);
+
+    void
+    ResumeParkedTask();
+
+    void
+    ResetTask();
+
+    void
+    DrainTask();
+
+    void
+    DecodedTaskCallDecoded(std::shared_ptr<cdm::Buffer> buf, cdm::AudioFormat fmt,
+                           uint32_t epoch);
+
+    void
+    ArmDeferredInitTimeout();
+
+    void
+    DeferredInitTimedOut();
+
+    void
+    DeferredInitTimeoutTask();
+
+    void
+    DeferredInitDoneTask(cdm::Status decoder_status);
+
     GMPAudioHost               *host_api_;
     GMPAudioDecoderCallback    *dec_cb_ = nullptr;;
+
+    GMPThread                  *worker_thread_ = nullptr;
+
+    std::vector<uint8_t>        extra_data_;
+
+    // see VideoDecoder
+    uint32_t                    cdm_id_ = 0;
+    bool                        own_cdm_ = false;
+
+    // CDM doesn't report layout of decoded audio, it matches the configuration
+    uint32_t                    channels_ = 0;
+    uint32_t                    rate_ = 0;
+
+    // incremented by Reset(); samples decoded on worker are tagged with it
+    std::atomic<uint32_t>       epoch_{0};
+
+    // input waiting for the worker; Decode() posts a new DecodeTask only when there is none
+    // pending already, so the worker picks up everything that piled up in a single pass
+    std::mutex                  pending_mutex_;
+    DecodeBatch                 pending_;
+    bool                        decode_task_posted_ = false;
+
+    // |samples_in| and |samples_out| are updated on main thread, other fields on worker thread
+    AudioStats                  stats_;
+
+    // accessed on worker thread only
+    DecoderInitState            init_state_ = DecoderInitState::kNotInitialized;
+    std::chrono::steady_clock::time_point deferred_since_;
+    DecodeBatch                 held_samples_;
+    DeferredInitStats           deferred_init_stats_;
+
+    // samples waiting for a key, in decode order
+    std::deque<std::shared_ptr<DecodeData>> parked_samples_;
+    ParkStats                   park_stats_;
 };
 
 inline std::string
@@ -0,0 +1,122 @@
+/*
+ * Copyright © 2016  Rinat Ibragimov
+ *
+ * This file is part of gmp-widevine.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "h264.hh"
+#include <lib/Endian.h>
+
+
+using mozilla::BigEndian;
+
+
+namespace h264 {
+
+namespace {
+
+enum NalUnitType {
+    kNalSlice = 1,
+    kNalIdrSlice = 5,
+};
+
+// Walks subsample map and tells whether bytes at monotonically increasing offsets are clear.
+class ClearRangeCursor {
+public:
+    explicit ClearRangeCursor(const std::vector<cdm::SubsampleEntry> &subsamples)
+        : subsamples_(subsamples)
+    {}
+
+    bool
+    is_clear(size_t offset)
+    {
+        if (subsamples_.empty())
+            return true;
+
+        while (idx_ < subsamples_.size()) {
+            const cdm::SubsampleEntry &e = subsamples_[idx_];
+            size_t clear_end = start_ + e.clear_bytes;
+            size_t cipher_end = clear_end + e.cipher_bytes;
+
+            if (offset < clear_end)
+                return offset >= start_;
+            if (offset < cipher_end)
+                return false;
+
+            start_ = cipher_end;
+            idx_ ++;
+        }
+
+        return false;
+    }
+
+private:
+    const std::vector<cdm::SubsampleEntry> &subsamples_;
+    size_t  idx_ = 0;
+    size_t  start_ = 0;
+};
+
+} // anonymous namespace
+
+FrameInfo
+inspect_avcc_frame(const uint8_t *data, size_t data_size,
+                   const std::vector<cdm::SubsampleEntry> &subsamples)
+{
+    FrameInfo info;
+    ClearRangeCursor cursor(subsamples);
+    bool seen_slice = false;
+    bool seen_reference_slice = false;
+
+    size_t pos = 0;
+    while (pos + 5 <= data_size) {
+        uint32_t nal_len = BigEndian::readUint32(data + pos);
+        size_t hdr_pos = pos + 4;
+
+        if (nal_len == 0 || nal_len > data_size - hdr_pos)
+            return FrameInfo();
+
+        if (!cursor.is_clear(hdr_pos))
+            return FrameInfo();
+
+        uint8_t hdr = data[hdr_pos];
+        uint8_t nal_ref_idc = (hdr >> 5) & 3;
+        uint8_t nal_unit_type = hdr & 0x1f;
+
+        if (nal_unit_type >= kNalSlice && nal_unit_type <= kNalIdrSlice) {
+            seen_slice = true;
+            if (nal_ref_idc != 0)
+                seen_reference_slice = true;
+            if (nal_unit_type == kNalIdrSlice)
+                info.has_idr = true;
+        }
+
+        pos = hdr_pos + nal_len;
+    }
+
+    if (!seen_slice)
+        return FrameInfo();
+
+    info.parsed = true;
+    info.is_reference = seen_reference_slice;
+    return info;
+}
+
+} // namespace h264
@@ -0,0 +1,49 @@
+/*
+ * Copyright © 2016  Rinat Ibragimov
+ *
+ * This file is part of gmp-widevine.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+#include <api/crcdm/content_decryption_module.h>
+
+
+namespace h264 {
+
+struct FrameInfo {
+    bool    parsed = false;         // slice headers were found and examined
+    bool    has_idr = false;        // contains an IDR slice
+    bool    is_reference = true;    // at least one slice has non-zero nal_ref_idc
+};
+
+// Looks at NAL unit headers of a sample in AVCC format (4-byte NAL length fields). Only headers
+// lying in clear parts of the sample are examined; if any slice header is encrypted or the
+// sample can't be parsed, |parsed| is false and frame is conservatively reported as a non-IDR
+// reference frame.
+FrameInfo
+inspect_avcc_frame(const uint8_t *data, size_t data_size,
+                   const std::vector<cdm::SubsampleEntry> &subsamples);
+
+} // namespace h264
@@ -0,0 +1,136 @@
+/*
+ * Copyright © 2016  Rinat Ibragimov
+ *
+ * This file is part of gmp-widevine.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "keys.hh"
+#include <map>
+#include <mutex>
+
+
+namespace keys {
+
+namespace {
+
+std::mutex  keys_mutex;
+
+// session id -> key id -> last known status
+std::map<std::string, std::map<KeyId, cdm::KeyStatus>> sessions;
+
+bool
+status_is_usable(cdm::KeyStatus status)
+{
+    // downscaled output still means CDM will decrypt
+    return status == cdm::kUsable || status == cdm::kOutputDownscaled;
+}
+
+bool
+is_usable_locked(const KeyId &key_id)
+{
+    for (const auto &s: sessions) {
+        auto it = s.second.find(key_id);
+        if (it != s.second.end() && status_is_usable(it->second))
+            return true;
+    }
+
+    return false;
+}
+
+} // anonymous namespace
+
+Changes
+update(const std::string &session_id, const cdm::KeyInformation *keys_info,
+       uint32_t keys_info_count)
+{
+    std::lock_guard<std::mutex> lock(keys_mutex);
+    Changes changes;
+
+    const auto &old_statuses = sessions[session_id];
+
+    // CDM reports full key set of a session each time, keys that are not mentioned are gone
+    std::map<KeyId, cdm::KeyStatus> new_statuses;
+    for (uint32_t k = 0; k < keys_info_count; k ++) {
+        KeyId key_id(keys_info[k].key_id, keys_info[k].key_id + keys_info[k].key_id_size);
+
+        auto it = old_statuses.find(key_id);
+        if (it == old_statuses.end() || it->second != keys_info[k].status)
+            changes.changed.push_back(k);
+
+        new_statuses[key_id] = keys_info[k].status;
+    }
+
+    for (const auto &it: new_statuses) {
+        if (status_is_usable(it.second) && !is_usable_locked(it.first))
+            changes.became_usable.push_back(it.first);
+    }
+
+    sessions[session_id].swap(new_statuses);
+
+    return changes;
+}
+
+void
+session_closed(const std::string &session_id)
+{
+    std::lock_guard<std::mutex> lock(keys_mutex);
+    sessions.erase(session_id);
+}
+
+void
+reset()
+{
+    std::lock_guard<std::mutex> lock(keys_mutex);
+    sessions.clear();
+}
+
+bool
+is_usable(const KeyId &key_id)
+{
+    std::lock_guard<std::mutex> lock(keys_mutex);
+    return is_usable_locked(key_id);
+}
+
+bool
+find_session_with_usable(const std::vector<KeyId> &key_ids, std::string &session_id)
+{
+    std::lock_guard<std::mutex> lock(keys_mutex);
+
+    for (const auto &s: sessions) {
+        bool all_usable = true;
+        for (const auto &key_id: key_ids) {
+            auto it = s.second.find(key_id);
+            if (it == s.second.end() || !status_is_usable(it->second)) {
+                all_usable = false;
+                break;
+            }
+        }
+
+        if (all_usable) {
+            session_id = s.first;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+} // namespace keys
@@ -0,0 +1,70 @@
+/*
+ * Copyright © 2016  Rinat Ibragimov
+ *
+ * This file is part of gmp-widevine.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <api/crcdm/content_decryption_module.h>
+
+
+namespace keys {
+
+typedef std::vector<uint8_t> KeyId;
+
+// Index of key statuses reported by CDM, for all open sessions. Updated from
+// crcdm::Host::OnSessionKeysChange(), can be queried from any thread.
+
+struct Changes {
+    // ids of keys that weren't usable in any session before the update, and now are
+    std::vector<KeyId>      became_usable;
+
+    // indices of |keys_info| entries whose status differs from the previous report for the
+    // session, or which weren't reported before
+    std::vector<uint32_t>   changed;
+};
+
+// Records statuses reported for |session_id|.
+Changes
+update(const std::string &session_id, const cdm::KeyInformation *keys_info,
+       uint32_t keys_info_count);
+
+// Forgets keys of a closed session.
+void
+session_closed(const std::string &session_id);
+
+// Forgets everything, when CDM instance goes away with all its sessions.
+void
+reset();
+
+bool
+is_usable(const KeyId &key_id);
+
+// Looks for an open session in which all of |key_ids| are usable. Stores its id to |session_id|.
+bool
+find_session_with_usable(const std::vector<KeyId> &key_ids, std::string &session_id);
+
+} // namespace keys
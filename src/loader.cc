@@ -0,0 +1,282 @@
+/*
+ * Copyright © 2016  Rinat Ibragimov
+ *
+ * This file is part of gmp-widevine.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "loader.hh"
+#include "log.hh"
+#include <dlfcn.h>
+#include <link.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <boost/format.hpp>
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <string>
+#include <vector>
+
+
+using boost::format;
+using std::string;
+
+
+namespace loader {
+
+namespace {
+
+const char kCdmLibraryName[] = "libwidevinecdm.so";
+const char kInfoFileName[] = "widevine.info";
+
+#define STRINGIFY(x) STRINGIFY_NO_EXPANSION(x)
+#define STRINGIFY_NO_EXPANSION(x) #x
+
+typedef void (*InitializeCdmModuleFunc)();
+typedef void (*DeinitializeCdmModuleFunc)();
+typedef void *(*CreateCdmInstanceFunc)(int cdm_interface_version, const char *key_system,
+                                       uint32_t key_system_size,
+                                       GetCdmHostFunc get_cdm_host_func, void *user_data);
+typedef const char *(*GetCdmVersionFunc)();
+
+bool                        load_attempted = false;
+bool                        loaded = false;
+void                       *cdm_handle = nullptr;
+InitializeCdmModuleFunc     initialize_cdm_module_ptr = nullptr;
+DeinitializeCdmModuleFunc   deinitialize_cdm_module_ptr = nullptr;
+CreateCdmInstanceFunc       create_cdm_instance_ptr = nullptr;
+
+string
+trim(const string &s)
+{
+    const char *ws = " \t\r\n";
+    const auto first = s.find_first_not_of(ws);
+    if (first == string::npos)
+        return string();
+
+    return s.substr(first, s.find_last_not_of(ws) - first + 1);
+}
+
+// Directory the adapter itself was loaded from, with trailing slash.
+string
+adapter_directory()
+{
+    Dl_info info;
+    if (dladdr(reinterpret_cast<void *>(&load), &info) == 0 || !info.dli_fname)
+        return string();
+
+    const string path {info.dli_fname};
+    const auto slash = path.rfind('/');
+    return slash == string::npos ? string() : path.substr(0, slash + 1);
+}
+
+// Returns CDM library candidates listed in widevine.info, in the order they are listed.
+std::vector<string>
+libraries_from_info()
+{
+    std::vector<string> libraries;
+    const string info_path = adapter_directory() + kInfoFileName;
+
+    std::ifstream info(info_path);
+    if (!info) {
+        LOGF << format("   can't read %1%\n") % info_path;
+        return libraries;
+    }
+
+    const string key {"Libraries:"};
+    string line;
+    while (std::getline(info, line)) {
+        if (line.compare(0, key.size(), key) != 0)
+            continue;
+
+        // comma separated list
+        const string value = line.substr(key.size());
+        size_t pos = 0;
+        while (pos <= value.size()) {
+            auto comma = value.find(',', pos);
+            if (comma == string::npos)
+                comma = value.size();
+
+            const string lib = trim(value.substr(pos, comma - pos));
+            if (!lib.empty())
+                libraries.push_back(lib);
+            pos = comma + 1;
+        }
+    }
+
+    return libraries;
+}
+
+void *
+open_library(const string &path)
+{
+    // already there, if Firefox preloaded it or it was LD_PRELOADed; doesn't need file access
+    void *handle = dlopen(path.c_str(), RTLD_NOW | RTLD_NOLOAD);
+    if (handle) {
+        LOGF << format("   %1% is loaded already\n") % path;
+        return handle;
+    }
+
+    // the only path that works before the sandbox is up; RTLD_NOW binds everything here rather
+    // than on first calls into CDM
+    handle = dlopen(path.c_str(), RTLD_NOW);
+    if (!handle)
+        LOGF << format("   dlopen(%1%) failed: %2%\n") % path % dlerror();
+
+    return handle;
+}
+
+template <typename T>
+bool
+resolve(const char *name, T &ptr)
+{
+    ptr = reinterpret_cast<T>(dlsym(cdm_handle, name));
+    if (!ptr) {
+        LOGZ << format("loader: CDM library has no %1%\n") % name;
+        return false;
+    }
+
+    return true;
+}
+
+struct PrefetchRange {
+    uintptr_t   addr;       // any address inside CDM library
+    size_t      bytes = 0;  // prefetched in total
+};
+
+int
+prefetch_phdr_cb(struct dl_phdr_info *info, size_t size, void *data)
+{
+    auto range = static_cast<PrefetchRange *>(data);
+    const uintptr_t page_size = sysconf(_SC_PAGESIZE);
+
+    bool is_cdm = false;
+    for (int k = 0; k < info->dlpi_phnum; k ++) {
+        const auto &ph = info->dlpi_phdr[k];
+        const uintptr_t start = info->dlpi_addr + ph.p_vaddr;
+        if (ph.p_type == PT_LOAD && range->addr >= start && range->addr < start + ph.p_memsz)
+            is_cdm = true;
+    }
+
+    if (!is_cdm)
+        return 0;
+
+    for (int k = 0; k < info->dlpi_phnum; k ++) {
+        const auto &ph = info->dlpi_phdr[k];
+        if (ph.p_type != PT_LOAD || !(ph.p_flags & PF_X))
+            continue;
+
+        const uintptr_t start = (info->dlpi_addr + ph.p_vaddr) & ~(page_size - 1);
+        const uintptr_t end = info->dlpi_addr + ph.p_vaddr + ph.p_memsz;
+
+        // read-ahead of the whole segment, then fault pages in one by one, so it all happens
+        // here instead of in decode path
+        madvise(reinterpret_cast<void *>(start), end - start, MADV_WILLNEED);
+
+        for (uintptr_t p = start; p < end; p += page_size)
+            (void)*reinterpret_cast<volatile const uint8_t *>(p);
+
+        range->bytes += end - start;
+    }
+
+    return 1;
+}
+
+} // anonymous namespace
+
+bool
+load()
+{
+    LOGF << "loader::load\n";
+
+    if (load_attempted)
+        return loaded;
+    load_attempted = true;
+
+    auto libraries = libraries_from_info();
+
+    // CDM usually is in the list along with its dependencies; try it first
+    std::stable_partition(libraries.begin(), libraries.end(), [](const string &lib) {
+        return lib.find(kCdmLibraryName) != string::npos;
+    });
+    libraries.push_back(kCdmLibraryName);
+
+    for (const auto &lib: libraries) {
+        cdm_handle = open_library(lib);
+        if (cdm_handle)
+            break;
+    }
+
+    if (!cdm_handle) {
+        LOGZ << "loader: can't load CDM library, check Libraries in widevine.info\n";
+        return false;
+    }
+
+    loaded = resolve(STRINGIFY(INITIALIZE_CDM_MODULE), initialize_cdm_module_ptr) &&
+             resolve("DeinitializeCdmModule", deinitialize_cdm_module_ptr) &&
+             resolve("CreateCdmInstance", create_cdm_instance_ptr);
+
+    GetCdmVersionFunc get_cdm_version = nullptr;
+    if (loaded && resolve("GetCdmVersion", get_cdm_version))
+        LOGF << format("   CDM version %1%\n") % get_cdm_version();
+
+    return loaded;
+}
+
+void
+prefetch()
+{
+    if (!loaded)
+        return;
+
+    auto start = std::chrono::steady_clock::now();
+
+    PrefetchRange range;
+    range.addr = reinterpret_cast<uintptr_t>(create_cdm_instance_ptr);
+    dl_iterate_phdr(prefetch_phdr_cb, &range);
+
+    LOGS << format("loader: prefetched %1% KiB of CDM code in %2% us\n") % (range.bytes / 1024) %
+            std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::steady_clock::now() - start).count();
+}
+
+void
+initialize_cdm_module()
+{
+    initialize_cdm_module_ptr();
+}
+
+void
+deinitialize_cdm_module()
+{
+    deinitialize_cdm_module_ptr();
+}
+
+void *
+create_cdm_instance(int cdm_interface_version, const char *key_system, uint32_t key_system_size,
+                    GetCdmHostFunc get_cdm_host_func, void *user_data)
+{
+    return create_cdm_instance_ptr(cdm_interface_version, key_system, key_system_size,
+                                   get_cdm_host_func, user_data);
+}
+
+} // namespace loader
@@ -0,0 +1,58 @@
+/*
+ * Copyright © 2016  Rinat Ibragimov
+ *
+ * This file is part of gmp-widevine.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <api/crcdm/content_decryption_module.h>
+
+
+namespace loader {
+
+// Locates CDM library and resolves its entry points. Library path is taken from the
+// "Libraries:" line of widevine.info lying next to the adapter. A copy already loaded by
+// Firefox or LD_PRELOAD is picked up without touching the file system, which is what works
+// once the sandbox is up. Returns false if CDM is not available. Main thread only; later calls
+// return the result of the first one.
+bool
+load();
+
+// Brings CDM code into memory, so the first calls into CDM don't page fault through a large
+// binary. Can be called on any thread after load().
+void
+prefetch();
+
+// CDM entry points; load() must have succeeded.
+void
+initialize_cdm_module();
+
+void
+deinitialize_cdm_module();
+
+void *
+create_cdm_instance(int cdm_interface_version, const char *key_system, uint32_t key_system_size,
+                    GetCdmHostFunc get_cdm_host_func, void *user_data);
+
+} // namespace loader
@@ -35,3 +35,11 @@
 #endif // DEBUG_TRACE
 
 #define LOGZ    std::cout << "gmp-widevine/Z: "
+
+//#define DEBUG_STATS
+
+#ifdef DEBUG_STATS
+#define LOGS    std::cout << "gmp-widevine/S: "
+#else
+#define LOGS    while (0) std::cout
+#endif // DEBUG_STATS
@@ -0,0 +1,417 @@
+/*
+ * Copyright © 2016  Rinat Ibragimov
+ *
+ * This file is part of gmp-widevine.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "planes.hh"
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define PLANES_X86 1
+#endif
+
+
+namespace planes {
+
+I420Image::I420Image(int32_t width, int32_t height)
+    : width_(width)
+    , height_(height)
+{
+    size_t offset = 0;
+    for (int p = kY; p < kNumPlanes; p ++) {
+        stride_[p] = aligned_stride(plane_width(static_cast<Plane>(p)));
+        offset_[p] = offset;
+        offset += plane_size(static_cast<Plane>(p));
+    }
+
+    void *ptr = nullptr;
+    if (posix_memalign(&ptr, kStrideAlignment, offset) == 0) {
+        data_ = static_cast<uint8_t *>(ptr);
+        size_ = offset;
+    }
+}
+
+I420Image::~I420Image()
+{
+    free(data_);
+}
+
+namespace {
+
+typedef void (*copy_row_func)(uint8_t *dst, const uint8_t *src, uint32_t width);
+
+void
+copy_row_c(uint8_t *dst, const uint8_t *src, uint32_t width)
+{
+    memcpy(dst, src, width);
+}
+
+#if PLANES_X86
+
+__attribute__((target("sse2"))) void
+copy_row_sse2(uint8_t *dst, const uint8_t *src, uint32_t width)
+{
+    uint32_t k = 0;
+    for (; k + 16 <= width; k += 16) {
+        __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + k));
+        _mm_store_si128(reinterpret_cast<__m128i *>(dst + k), a);
+    }
+    memcpy(dst + k, src + k, width - k);
+}
+
+__attribute__((target("sse2"))) void
+copy_row_sse2_nt(uint8_t *dst, const uint8_t *src, uint32_t width)
+{
+    uint32_t k = 0;
+    for (; k + 16 <= width; k += 16) {
+        __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + k));
+        _mm_stream_si128(reinterpret_cast<__m128i *>(dst + k), a);
+    }
+    memcpy(dst + k, src + k, width - k);
+}
+
+__attribute__((target("avx2"))) void
+copy_row_avx2(uint8_t *dst, const uint8_t *src, uint32_t width)
+{
+    uint32_t k = 0;
+    for (; k + 32 <= width; k += 32) {
+        __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + k));
+        _mm256_store_si256(reinterpret_cast<__m256i *>(dst + k), a);
+    }
+    memcpy(dst + k, src + k, width - k);
+}
+
+__attribute__((target("avx2"))) void
+copy_row_avx2_nt(uint8_t *dst, const uint8_t *src, uint32_t width)
+{
+    uint32_t k = 0;
+    for (; k + 32 <= width; k += 32) {
+        __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + k));
+        _mm256_stream_si256(reinterpret_cast<__m256i *>(dst + k), a);
+    }
+    memcpy(dst + k, src + k, width - k);
+}
+
+#endif // PLANES_X86
+
+struct CopyKernels {
+    copy_row_func   copy_row;
+    copy_row_func   copy_row_nt;
+    bool            needs_sfence;
+};
+
+CopyKernels
+select_copy_kernels()
+{
+#if PLANES_X86
+    __builtin_cpu_init();
+
+    if (__builtin_cpu_supports("avx2"))
+        return CopyKernels{copy_row_avx2, copy_row_avx2_nt, true};
+
+    if (__builtin_cpu_supports("sse2"))
+        return CopyKernels{copy_row_sse2, copy_row_sse2_nt, true};
+#endif // PLANES_X86
+
+    return CopyKernels{copy_row_c, copy_row_c, false};
+}
+
+const CopyKernels &
+copy_kernels()
+{
+    static const CopyKernels kernels = select_copy_kernels();
+    return kernels;
+}
+
+} // anonymous namespace
+
+void
+copy_plane(uint8_t *dst, uint32_t dst_stride, const uint8_t *src, uint32_t src_stride,
+           uint32_t width, uint32_t rows, bool non_temporal)
+{
+    const CopyKernels &kernels = copy_kernels();
+    copy_row_func copy_row = non_temporal ? kernels.copy_row_nt : kernels.copy_row;
+
+    for (uint32_t k = 0; k < rows; k ++)
+        copy_row(dst + k * dst_stride, src + k * src_stride, width);
+
+#if PLANES_X86
+    if (non_temporal && kernels.needs_sfence)
+        _mm_sfence();
+#endif // PLANES_X86
+}
+
+namespace {
+
+// Averages 2x2 blocks of |src| into |dst|. Odd last row or column are averaged with themselves.
+void
+halve_plane_c(uint8_t *dst, uint32_t dst_stride, const uint8_t *src, uint32_t src_stride,
+              uint32_t src_width, uint32_t src_height, uint32_t start_col)
+{
+    const uint32_t dst_width = (src_width + 1) / 2;
+    const uint32_t dst_height = (src_height + 1) / 2;
+
+    for (uint32_t r = 0; r < dst_height; r ++) {
+        const uint8_t *row0 = src + 2 * r * src_stride;
+        const uint8_t *row1 = (2 * r + 1 < src_height) ? row0 + src_stride : row0;
+        uint8_t *out = dst + r * dst_stride;
+
+        for (uint32_t c = start_col; c < dst_width; c ++) {
+            uint32_t c0 = 2 * c;
+            uint32_t c1 = (c0 + 1 < src_width) ? c0 + 1 : c0;
+            out[c] = (row0[c0] + row0[c1] + row1[c0] + row1[c1] + 2) / 4;
+        }
+    }
+}
+
+#if PLANES_X86
+
+__attribute__((target("sse2"))) void
+halve_plane_sse2(uint8_t *dst, uint32_t dst_stride, const uint8_t *src, uint32_t src_stride,
+                 uint32_t src_width, uint32_t src_height)
+{
+    const uint32_t dst_height = (src_height + 1) / 2;
+    const uint32_t simd_cols = (src_width / 32) * 16;   // output columns handled by SIMD loop
+    const __m128i low_bytes = _mm_set1_epi16(0x00ff);
+
+    for (uint32_t r = 0; r < dst_height; r ++) {
+        const uint8_t *row0 = src + 2 * r * src_stride;
+        const uint8_t *row1 = (2 * r + 1 < src_height) ? row0 + src_stride : row0;
+        uint8_t *out = dst + r * dst_stride;
+
+        for (uint32_t c = 0; c < simd_cols; c += 16) {
+            __m128i a0 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(row0 + 2 * c));
+            __m128i a1 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(row0 + 2 * c + 16));
+            __m128i b0 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(row1 + 2 * c));
+            __m128i b1 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(row1 + 2 * c + 16));
+
+            // sum horizontal pairs as 16-bit values, then add two rows together
+            __m128i s0 = _mm_add_epi16(_mm_add_epi16(_mm_and_si128(a0, low_bytes),
+                                                     _mm_srli_epi16(a0, 8)),
+                                       _mm_add_epi16(_mm_and_si128(b0, low_bytes),
+                                                     _mm_srli_epi16(b0, 8)));
+            __m128i s1 = _mm_add_epi16(_mm_add_epi16(_mm_and_si128(a1, low_bytes),
+                                                     _mm_srli_epi16(a1, 8)),
+                                       _mm_add_epi16(_mm_and_si128(b1, low_bytes),
+                                                     _mm_srli_epi16(b1, 8)));
+
+            const __m128i two = _mm_set1_epi16(2);
+            s0 = _mm_srli_epi16(_mm_add_epi16(s0, two), 2);
+            s1 = _mm_srli_epi16(_mm_add_epi16(s1, two), 2);
+
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(out + c), _mm_packus_epi16(s0, s1));
+        }
+    }
+
+    halve_plane_c(dst, dst_stride, src, src_stride, src_width, src_height, simd_cols);
+}
+
+#endif // PLANES_X86
+
+void
+halve_plane(uint8_t *dst, uint32_t dst_stride, const uint8_t *src, uint32_t src_stride,
+            uint32_t src_width, uint32_t src_height)
+{
+#if PLANES_X86
+    static const bool have_sse2 = __builtin_cpu_supports("sse2");
+    if (have_sse2) {
+        halve_plane_sse2(dst, dst_stride, src, src_stride, src_width, src_height);
+        return;
+    }
+#endif // PLANES_X86
+
+    halve_plane_c(dst, dst_stride, src, src_stride, src_width, src_height, 0);
+}
+
+// Blends two rows with 8-bit weights (256 - fy) and fy into 16-bit sums, which can't overflow.
+void
+blend_rows_c(uint16_t *dst, const uint8_t *row0, const uint8_t *row1, uint32_t fy,
+             uint32_t width, uint32_t start_col)
+{
+    for (uint32_t c = start_col; c < width; c ++)
+        dst[c] = row0[c] * (256 - fy) + row1[c] * fy;
+}
+
+#if PLANES_X86
+
+__attribute__((target("sse2"))) void
+blend_rows_sse2(uint16_t *dst, const uint8_t *row0, const uint8_t *row1, uint32_t fy,
+                uint32_t width)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i w0 = _mm_set1_epi16(256 - fy);
+    const __m128i w1 = _mm_set1_epi16(fy);
+
+    uint32_t c = 0;
+    for (; c + 16 <= width; c += 16) {
+        __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i *>(row0 + c));
+        __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i *>(row1 + c));
+
+        // products are at most 255 * 256, and so is their sum, as weights add up to 256
+        __m128i lo = _mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(a, zero), w0),
+                                   _mm_mullo_epi16(_mm_unpacklo_epi8(b, zero), w1));
+        __m128i hi = _mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(a, zero), w0),
+                                   _mm_mullo_epi16(_mm_unpackhi_epi8(b, zero), w1));
+
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + c), lo);
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + c + 8), hi);
+    }
+
+    blend_rows_c(dst, row0, row1, fy, width, c);
+}
+
+#endif // PLANES_X86
+
+void
+blend_rows(uint16_t *dst, const uint8_t *row0, const uint8_t *row1, uint32_t fy, uint32_t width)
+{
+#if PLANES_X86
+    static const bool have_sse2 = __builtin_cpu_supports("sse2");
+    if (have_sse2) {
+        blend_rows_sse2(dst, row0, row1, fy, width);
+        return;
+    }
+#endif // PLANES_X86
+
+    blend_rows_c(dst, row0, row1, fy, width, 0);
+}
+
+// Filter is separable: each output row blends two source rows vertically first, over whole
+// rows, which is SIMD-friendly; horizontal taps differ per column and stay scalar, but are only
+// computed once per plane. Rounding happens once at the end, so the result is the same as
+// blending 2x2 neighbours directly.
+void
+bilinear_plane(uint8_t *dst, uint32_t dst_stride, uint32_t dst_width, uint32_t dst_height,
+               const uint8_t *src, uint32_t src_stride, uint32_t src_width, uint32_t src_height)
+{
+    // 16.16 fixed point source coordinates of destination pixel centers
+    const int64_t x_step = (int64_t(src_width) << 16) / dst_width;
+    const int64_t y_step = (int64_t(src_height) << 16) / dst_height;
+    const int64_t x_max = int64_t(src_width - 1) << 16;
+    const int64_t y_max = int64_t(src_height - 1) << 16;
+
+    auto clamp = [](int64_t v, int64_t hi) { return v < 0 ? 0 : (v > hi ? hi : v); };
+
+    struct Tap {
+        uint32_t    x0;
+        uint32_t    x1;
+        uint32_t    fx;
+    };
+
+    std::vector<Tap> taps(dst_width);
+    for (uint32_t c = 0; c < dst_width; c ++) {
+        int64_t sx = clamp(x_step * c + x_step / 2 - 0x8000, x_max);
+        taps[c].x0 = sx >> 16;
+        taps[c].x1 = (taps[c].x0 + 1 < src_width) ? taps[c].x0 + 1 : taps[c].x0;
+        taps[c].fx = (sx >> 8) & 0xff;
+    }
+
+    std::vector<uint16_t> blended(src_width);
+
+    for (uint32_t r = 0; r < dst_height; r ++) {
+        int64_t sy = clamp(y_step * r + y_step / 2 - 0x8000, y_max);
+        uint32_t y0 = sy >> 16;
+        uint32_t y1 = (y0 + 1 < src_height) ? y0 + 1 : y0;
+        uint32_t fy = (sy >> 8) & 0xff;
+
+        blend_rows(blended.data(), src + y0 * src_stride, src + y1 * src_stride, fy, src_width);
+
+        uint8_t *out = dst + r * dst_stride;
+        for (uint32_t c = 0; c < dst_width; c ++) {
+            const Tap &t = taps[c];
+            out[c] = (blended[t.x0] * (256 - t.fx) + blended[t.x1] * t.fx + (1 << 15)) >> 16;
+        }
+    }
+}
+
+} // anonymous namespace
+
+std::shared_ptr<I420Image>
+repack_i420(int32_t width, int32_t height, const PlaneRef &y, const PlaneRef &u,
+            const PlaneRef &v)
+{
+    auto img = std::make_shared<I420Image>(width, height);
+    if (!img->valid())
+        return nullptr;
+
+    const bool non_temporal = img->size() >= kNonTemporalThreshold;
+    const PlaneRef *src[kNumPlanes] = {&y, &u, &v};
+
+    for (int k = kY; k < kNumPlanes; k ++) {
+        Plane p = static_cast<Plane>(k);
+        copy_plane(img->plane(p), img->stride(p), src[k]->data, src[k]->stride,
+                   img->plane_width(p), img->plane_height(p), non_temporal);
+    }
+
+    return img;
+}
+
+std::shared_ptr<I420Image>
+scale_i420(int32_t width, int32_t height, const PlaneRef &y, const PlaneRef &u, const PlaneRef &v,
+           int32_t dst_width, int32_t dst_height)
+{
+    PlaneRef src[kNumPlanes] = {y, u, v};
+    int32_t cur_width = width;
+    int32_t cur_height = height;
+    std::shared_ptr<I420Image> cur;
+
+    while (cur_width >= 2 * dst_width && cur_height >= 2 * dst_height) {
+        auto half = std::make_shared<I420Image>((cur_width + 1) / 2, (cur_height + 1) / 2);
+        if (!half->valid())
+            return nullptr;
+
+        for (int k = kY; k < kNumPlanes; k ++) {
+            Plane p = static_cast<Plane>(k);
+            uint32_t src_width = (p == kY) ? cur_width : (cur_width + 1) / 2;
+            uint32_t src_height = (p == kY) ? cur_height : (cur_height + 1) / 2;
+            halve_plane(half->plane(p), half->stride(p), src[k].data, src[k].stride, src_width,
+                        src_height);
+            src[k] = PlaneRef{half->plane(p), half->stride(p)};
+        }
+
+        cur = half;
+        cur_width = half->width();
+        cur_height = half->height();
+    }
+
+    if (cur_width == dst_width && cur_height == dst_height)
+        return cur ? cur : repack_i420(width, height, y, u, v);
+
+    auto img = std::make_shared<I420Image>(dst_width, dst_height);
+    if (!img->valid())
+        return nullptr;
+
+    for (int k = kY; k < kNumPlanes; k ++) {
+        Plane p = static_cast<Plane>(k);
+        uint32_t src_width = (p == kY) ? cur_width : (cur_width + 1) / 2;
+        uint32_t src_height = (p == kY) ? cur_height : (cur_height + 1) / 2;
+        bilinear_plane(img->plane(p), img->stride(p), img->plane_width(p), img->plane_height(p),
+                       src[k].data, src[k].stride, src_width, src_height);
+    }
+
+    return img;
+}
+
+} // namespace planes
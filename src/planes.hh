@@ -0,0 +1,132 @@
+/*
+ * Copyright © 2016  Rinat Ibragimov
+ *
+ * This file is part of gmp-widevine.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <memory>
+
+
+namespace planes {
+
+// Output planes are padded to a multiple of this many bytes, which is also the alignment of
+// plane starts.
+const uint32_t kStrideAlignment = 32;
+
+// Frames larger than that are written with non-temporal stores, to avoid evicting everything
+// else from cache.
+const size_t kNonTemporalThreshold = 4 * 1024 * 1024;
+
+inline uint32_t
+aligned_stride(uint32_t width)
+{
+    return (width + kStrideAlignment - 1) & ~(kStrideAlignment - 1);
+}
+
+enum Plane {
+    kY = 0,
+    kU = 1,
+    kV = 2,
+    kNumPlanes = 3,
+};
+
+// 8-bit planar YUV 4:2:0 image in I420 plane order, with tight 32-byte aligned strides.
+class I420Image
+{
+public:
+    I420Image(int32_t width, int32_t height);
+
+    ~I420Image();
+
+    I420Image(const I420Image &) = delete;
+    I420Image &operator=(const I420Image &) = delete;
+
+    bool
+    valid() const { return data_ != nullptr; }
+
+    int32_t
+    width() const { return width_; }
+
+    int32_t
+    height() const { return height_; }
+
+    uint32_t
+    plane_width(Plane p) const { return p == kY ? width_ : (width_ + 1) / 2; }
+
+    uint32_t
+    plane_height(Plane p) const { return p == kY ? height_ : (height_ + 1) / 2; }
+
+    uint32_t
+    stride(Plane p) const { return stride_[p]; }
+
+    uint32_t
+    plane_size(Plane p) const { return stride_[p] * plane_height(p); }
+
+    uint8_t *
+    plane(Plane p) { return data_ + offset_[p]; }
+
+    const uint8_t *
+    plane(Plane p) const { return data_ + offset_[p]; }
+
+    size_t
+    size() const { return size_; }
+
+private:
+    int32_t     width_;
+    int32_t     height_;
+    uint32_t    stride_[kNumPlanes];
+    size_t      offset_[kNumPlanes];
+    size_t      size_ = 0;
+    uint8_t    *data_ = nullptr;
+};
+
+// Source plane as it is laid out by CDM.
+struct PlaneRef {
+    const uint8_t  *data;
+    uint32_t        stride;
+};
+
+// Copies |rows| rows of |width| bytes each. |dst| and |dst_stride| must be 32-byte aligned.
+void
+copy_plane(uint8_t *dst, uint32_t dst_stride, const uint8_t *src, uint32_t src_stride,
+           uint32_t width, uint32_t rows, bool non_temporal);
+
+// Repacks planes of a decoded frame into a tightly packed I420 image. Source planes are
+// identified by their role, so both YV12 (V before U in memory) and I420 CDM frames come out in
+// I420 order. Returns nullptr if allocation fails.
+std::shared_ptr<I420Image>
+repack_i420(int32_t width, int32_t height, const PlaneRef &y, const PlaneRef &u,
+            const PlaneRef &v);
+
+// Scales planes of a decoded frame down to |dst_width|x|dst_height|, producing a tightly packed
+// I420 image. While source is at least twice as large as destination, it's halved with a SIMD
+// 2x2 box filter; the remaining non-integer factor is handled by a bilinear filter, whose
+// vertical pass uses SIMD too, while horizontal one is scalar. Returns nullptr if allocation
+// fails.
+std::shared_ptr<I420Image>
+scale_i420(int32_t width, int32_t height, const PlaneRef &y, const PlaneRef &u, const PlaneRef &v,
+           int32_t dst_width, int32_t dst_height);
+
+} // namespace planes
@@ -0,0 +1,175 @@
+/*
+ * Copyright © 2016  Rinat Ibragimov
+ *
+ * This file is part of gmp-widevine.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "pssh.hh"
+#include <algorithm>
+#include <string.h>
+
+
+namespace pssh {
+
+namespace {
+
+const uint8_t kWidevineSystemId[16] = {
+    0xed, 0xef, 0x8b, 0xa9, 0x79, 0xd6, 0x4a, 0xce,
+    0xa3, 0xc8, 0x27, 0xdc, 0xd5, 0x1d, 0x21, 0xed,
+};
+
+const uint32_t kKeyIdSize = 16;
+
+// WidevinePsshData.key_id, repeated bytes
+const uint32_t kWidevineKeyIdField = 2;
+
+uint32_t
+read_u32(const uint8_t *p)
+{
+    return (uint32_t(p[0]) << 24) | (uint32_t(p[1]) << 16) | (uint32_t(p[2]) << 8) | p[3];
+}
+
+bool
+read_varint(const uint8_t *&p, const uint8_t *end, uint64_t &value)
+{
+    value = 0;
+    for (int shift = 0; shift < 64 && p < end; shift += 7) {
+        const uint8_t b = *p++;
+        value |= uint64_t(b & 0x7f) << shift;
+        if ((b & 0x80) == 0)
+            return true;
+    }
+
+    return false;
+}
+
+void
+add_key_id(std::vector<keys::KeyId> &key_ids, const uint8_t *p)
+{
+    keys::KeyId key_id(p, p + kKeyIdSize);
+    if (std::find(key_ids.begin(), key_ids.end(), key_id) == key_ids.end())
+        key_ids.push_back(key_id);
+}
+
+// Walks protobuf fields of WidevinePsshData, picking key ids.
+void
+parse_widevine_data(const uint8_t *p, const uint8_t *end, std::vector<keys::KeyId> &key_ids)
+{
+    while (p < end) {
+        uint64_t tag;
+        if (!read_varint(p, end, tag))
+            return;
+
+        const uint64_t field = tag >> 3;
+
+        switch (tag & 7) {
+        case 0: {
+            uint64_t value;
+            if (!read_varint(p, end, value))
+                return;
+            break;
+        }
+
+        case 1:
+            if (end - p < 8)
+                return;
+            p += 8;
+            break;
+
+        case 2: {
+            uint64_t len;
+            if (!read_varint(p, end, len) || len > uint64_t(end - p))
+                return;
+
+            if (field == kWidevineKeyIdField && len == kKeyIdSize)
+                add_key_id(key_ids, p);
+
+            p += len;
+            break;
+        }
+
+        case 5:
+            if (end - p < 4)
+                return;
+            p += 4;
+            break;
+
+        default:
+            return;
+        }
+    }
+}
+
+} // anonymous namespace
+
+std::vector<keys::KeyId>
+parse_key_ids(const uint8_t *data, uint32_t data_size)
+{
+    std::vector<keys::KeyId> key_ids;
+    const uint8_t *p = data;
+    const uint8_t *const end = data + data_size;
+
+    // size, type, version and flags, system id
+    const uint32_t kHeaderSize = 4 + 4 + 4 + 16;
+
+    while (uint32_t(end - p) >= kHeaderSize) {
+        const uint32_t box_size = read_u32(p);
+        if (box_size < kHeaderSize + 4 || box_size > uint32_t(end - p))
+            break;
+
+        const uint8_t *const box_end = p + box_size;
+
+        if (memcmp(p + 4, "pssh", 4) != 0) {
+            p = box_end;
+            continue;
+        }
+
+        const uint8_t version = p[8];
+        const uint8_t *system_id = p + 12;
+        const uint8_t *q = p + kHeaderSize;
+        p = box_end;
+
+        if (version > 0) {
+            const uint32_t kid_count = read_u32(q);
+            q += 4;
+            if (kid_count > uint32_t(box_end - q) / kKeyIdSize)
+                break;
+
+            for (uint32_t k = 0; k < kid_count; k ++, q += kKeyIdSize)
+                add_key_id(key_ids, q);
+        }
+
+        if (box_end - q < 4)
+            break;
+
+        const uint32_t pssh_data_size = read_u32(q);
+        q += 4;
+        if (pssh_data_size > uint32_t(box_end - q))
+            break;
+
+        if (memcmp(system_id, kWidevineSystemId, sizeof(kWidevineSystemId)) == 0)
+            parse_widevine_data(q, q + pssh_data_size, key_ids);
+    }
+
+    return key_ids;
+}
+
+} // namespace pssh
@@ -0,0 +1,694 @@
+/*
+ * Copyright © 2016  Rinat Ibragimov
+ *
+ * This file is part of gmp-widevine.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "storage.hh"
+#include "chromecdm.hh"
+#include "firefoxcdm.hh"
+#include "log.hh"
+#include <api/gmp/gmp-platform.h>
+#include <api/gmp/gmp-storage.h>
+#include <lib/gmp-task-utils.h>
+#include <lib/RefCounted.h>
+#include <boost/format.hpp>
+#include <map>
+#include <memory>
+#include <set>
+#include <string>
+#include <vector>
+
+
+using std::string;
+using boost::format;
+
+
+namespace storage {
+
+namespace {
+
+class FileIO;
+
+struct Stats {
+    uint32_t    startup_round_trips = 0;
+    uint32_t    round_trips = 0;
+    uint32_t    opens_from_cache = 0;
+    uint32_t    reads_from_cache = 0;
+    uint32_t    writes = 0;
+    uint32_t    writes_coalesced = 0;
+    bool        startup = true;
+};
+
+Stats stats;
+
+// names of records present in storage, filled by enumerator at init()
+std::set<string>    known_names;
+bool                enumerated = false;
+bool                enumeration_started = false;
+
+void
+count_round_trip()
+{
+    stats.round_trips ++;
+    if (stats.startup)
+        stats.startup_round_trips ++;
+}
+
+cdm::FileIOClient::Status
+to_FileIOClient_Status(GMPErr status)
+{
+    switch (status) {
+    case GMPNoErr:       return cdm::FileIOClient::kSuccess;
+    case GMPRecordInUse: return cdm::FileIOClient::kInUse;
+    default:             return cdm::FileIOClient::kError;
+    }
+}
+
+// Shared state of a single named record. Outlives FileIO objects, keeping both cached contents
+// and the GMPRecord, while a flush is still in flight.
+class Record final : public GMPRecordClient {
+public:
+    explicit Record(const string &name)
+        : name_(name)
+    {
+    }
+
+    virtual void
+    OpenComplete(GMPErr aStatus) override;
+
+    virtual void
+    ReadComplete(GMPErr aStatus, const uint8_t *aData, uint32_t aDataSize) override;
+
+    virtual void
+    WriteComplete(GMPErr aStatus) override;
+
+    // Returns false if another FileIO holds the record.
+    bool
+    attach(FileIO *file_io);
+
+    void
+    detach(FileIO *file_io);
+
+    void
+    read(FileIO *file_io);
+
+    void
+    write(FileIO *file_io, const uint8_t *data, uint32_t data_size);
+
+    bool
+    is_open() const { return state_ == State::kOpen; }
+
+    // Whether opening can be answered without asking GMP. That's the case when contents are
+    // cached or the record is known to not exist yet.
+    bool
+    can_skip_open();
+
+    // Opens GMP record if it's not open yet. |opener|, if not null, gets notified on completion.
+    void
+    open(FileIO *opener);
+
+private:
+    enum class State { kClosed, kOpening, kOpen };
+
+    void
+    fail_all(GMPErr status);
+
+    void
+    run_queued_ops();
+
+    void
+    flush();
+
+    void
+    close_if_idle();
+
+    // Returns and clears failure of the last flush, as writes complete before flushing.
+    bool
+    take_flush_error();
+
+    string                  name_;
+    GMPRecord              *rec_ = nullptr;
+    State                   state_ = State::kClosed;
+
+    bool                    cached_ = false;
+    std::vector<uint8_t>    data_;
+
+    FileIO                 *owner_ = nullptr;
+    FileIO                 *opener_ = nullptr;  // waits for OpenComplete
+    FileIO                 *reader_ = nullptr;  // waits for ReadComplete
+    bool                    read_in_flight_ = false;
+
+    bool                    write_in_flight_ = false;
+    bool                    flush_pending_ = false;
+    bool                    flush_error_ = false;   // reported by the next read or write
+};
+
+std::map<string, std::unique_ptr<Record>> records;
+
+class FileIO final : public cdm::FileIO, public RefCounted {
+public:
+    explicit FileIO(cdm::FileIOClient *client)
+        : client_(client)
+    {
+        AddRef();
+    }
+
+    virtual void
+    Open(const char *file_name, uint32_t file_name_size) override
+    {
+        LOGF << format("storage::FileIO::Open file_name=%1%, file_name_size=%2%\n") %
+                string(file_name, file_name_size) % file_name_size;
+
+        const string name(file_name, file_name_size);
+        auto &rec = records[name];
+        if (!rec)
+            rec.reset(new Record(name));
+
+        if (record_) {
+            post_open_complete(cdm::FileIOClient::kError);
+            return;
+        }
+
+        if (!rec->attach(this)) {
+            post_open_complete(cdm::FileIOClient::kInUse);
+            return;
+        }
+
+        record_ = rec.get();
+
+        if (record_->is_open() || record_->can_skip_open()) {
+            stats.opens_from_cache ++;
+            opened_ = true;
+            post_open_complete(cdm::FileIOClient::kSuccess);
+            return;
+        }
+
+        op_pending_ = true;
+        record_->open(this);
+    }
+
+    virtual void
+    Read() override
+    {
+        LOGF << "storage::FileIO::Read (void)\n";
+
+        if (op_pending_) {
+            post_read_complete(cdm::FileIOClient::kInUse, std::vector<uint8_t>());
+            return;
+        }
+
+        if (!opened_) {
+            post_read_complete(cdm::FileIOClient::kError, std::vector<uint8_t>());
+            return;
+        }
+
+        op_pending_ = true;
+        record_->read(this);
+    }
+
+    virtual void
+    Write(const uint8_t *data, uint32_t data_size) override
+    {
+        LOGF << format("storage::FileIO::Write data=%1%, data_size=%2%\n") %
+                static_cast<const void *>(data) % data_size;
+
+        if (op_pending_) {
+            post_write_complete(cdm::FileIOClient::kInUse);
+            return;
+        }
+
+        if (!opened_) {
+            post_write_complete(cdm::FileIOClient::kError);
+            return;
+        }
+
+        op_pending_ = true;
+        record_->write(this, data, data_size);
+    }
+
+    virtual void
+    Close() override
+    {
+        LOGF << "storage::FileIO::Close (void)\n";
+
+        closed_ = true;
+        if (record_)
+            record_->detach(this);
+        record_ = nullptr;
+
+        // pending completion tasks hold references, object goes away after they run
+        Release();
+    }
+
+    void
+    post_open_complete(cdm::FileIOClient::Status status)
+    {
+        fxcdm::get_platform_api()->runonmainthread(
+            WrapTaskRefCounted(this, &FileIO::OpenCompleteTask, status));
+    }
+
+    void
+    post_read_complete(cdm::FileIOClient::Status status, std::vector<uint8_t> data)
+    {
+        fxcdm::get_platform_api()->runonmainthread(
+            WrapTaskRefCounted(this, &FileIO::ReadCompleteTask, status, data));
+    }
+
+    void
+    post_write_complete(cdm::FileIOClient::Status status)
+    {
+        fxcdm::get_platform_api()->runonmainthread(
+            WrapTaskRefCounted(this, &FileIO::WriteCompleteTask, status));
+    }
+
+    // Called by Record when GMP finished opening the record for this FileIO.
+    void
+    opened(cdm::FileIOClient::Status status)
+    {
+        op_pending_ = false;
+        opened_ = (status == cdm::FileIOClient::kSuccess);
+        if (!opened_ && record_) {
+            record_->detach(this);
+            record_ = nullptr;
+        }
+
+        post_open_complete(status);
+    }
+
+    void
+    read_done(cdm::FileIOClient::Status status, const std::vector<uint8_t> &data)
+    {
+        op_pending_ = false;
+        post_read_complete(status, data);
+    }
+
+    void
+    write_done(cdm::FileIOClient::Status status)
+    {
+        op_pending_ = false;
+        post_write_complete(status);
+    }
+
+private:
+    void
+    OpenCompleteTask(cdm::FileIOClient::Status status)
+    {
+        crcdm::ScopedLock lock;
+        if (!closed_)
+            client_->OnOpenComplete(status);
+    }
+
+    void
+    ReadCompleteTask(cdm::FileIOClient::Status status, std::vector<uint8_t> data)
+    {
+        crcdm::ScopedLock lock;
+        if (!closed_)
+            client_->OnReadComplete(status, data.data(), data.size());
+    }
+
+    void
+    WriteCompleteTask(cdm::FileIOClient::Status status)
+    {
+        crcdm::ScopedLock lock;
+        if (!closed_)
+            client_->OnWriteComplete(status);
+    }
+
+    cdm::FileIOClient  *client_;
+    Record             *record_ = nullptr;
+    bool                opened_ = false;
+    bool                op_pending_ = false;
+    bool                closed_ = false;
+};
+
+bool
+Record::attach(FileIO *file_io)
+{
+    // records are opened by this process only, so holding the name here is what GMP would
+    // report as "in use"
+    if (owner_ && owner_ != file_io)
+        return false;
+
+    owner_ = file_io;
+    return true;
+}
+
+void
+Record::detach(FileIO *file_io)
+{
+    if (owner_ == file_io)
+        owner_ = nullptr;
+    if (opener_ == file_io)
+        opener_ = nullptr;
+    if (reader_ == file_io)
+        reader_ = nullptr;
+
+    // data written before Close() is still flushed
+    close_if_idle();
+}
+
+bool
+Record::can_skip_open()
+{
+    if (cached_)
+        return true;
+
+    if (enumerated && known_names.count(name_) == 0) {
+        // doesn't exist yet, reads would return nothing
+        cached_ = true;
+        data_.clear();
+        return true;
+    }
+
+    return false;
+}
+
+void
+Record::open(FileIO *opener)
+{
+    if (opener)
+        opener_ = opener;
+
+    if (state_ != State::kClosed)
+        return;
+
+    GMPErr err = fxcdm::get_platform_api()->createrecord(name_.c_str(), name_.size(), &rec_,
+                                                         this);
+    if (GMP_SUCCEEDED(err))
+        err = rec_->Open();
+
+    if (GMP_FAILED(err)) {
+        LOGZ << format("storage: can't open record %1%, err=%2%\n") % name_ % err;
+        if (rec_)
+            rec_->Close();
+        rec_ = nullptr;
+        fail_all(err);
+        return;
+    }
+
+    count_round_trip();
+    state_ = State::kOpening;
+}
+
+void
+Record::OpenComplete(GMPErr aStatus)
+{
+    LOGF << format("storage::Record::OpenComplete aStatus=%1%\n") % aStatus;
+
+    if (GMP_FAILED(aStatus)) {
+        rec_->Close();
+        rec_ = nullptr;
+        state_ = State::kClosed;
+        fail_all(aStatus);
+        return;
+    }
+
+    state_ = State::kOpen;
+
+    if (opener_) {
+        FileIO *opener = opener_;
+        opener_ = nullptr;
+        opener->opened(cdm::FileIOClient::kSuccess);
+    }
+
+    run_queued_ops();
+}
+
+void
+Record::fail_all(GMPErr status)
+{
+    const auto fio_status = to_FileIOClient_Status(status);
+
+    if (opener_) {
+        FileIO *opener = opener_;
+        opener_ = nullptr;
+        opener->opened(fio_status);
+    }
+
+    if (reader_) {
+        reader_->read_done(fio_status, std::vector<uint8_t>());
+        reader_ = nullptr;
+    }
+
+    if (flush_pending_) {
+        LOGZ << format("storage: record %1% not written, err=%2%\n") % name_ % status;
+        flush_pending_ = false;
+        flush_error_ = true;
+        cached_ = false;
+        data_.clear();
+    }
+}
+
+void
+Record::run_queued_ops()
+{
+    // GMPRecord handles one operation at a time
+    if (state_ != State::kOpen || read_in_flight_ || write_in_flight_)
+        return;
+
+    if (reader_ && !read_in_flight_) {
+        count_round_trip();
+        read_in_flight_ = true;
+        rec_->Read();
+        return;
+    }
+
+    if (flush_pending_) {
+        flush();
+        return;
+    }
+
+    close_if_idle();
+}
+
+bool
+Record::take_flush_error()
+{
+    bool flush_error = flush_error_;
+    flush_error_ = false;
+    return flush_error;
+}
+
+void
+Record::read(FileIO *file_io)
+{
+    if (take_flush_error()) {
+        file_io->read_done(cdm::FileIOClient::kError, std::vector<uint8_t>());
+        return;
+    }
+
+    if (cached_) {
+        stats.reads_from_cache ++;
+        file_io->read_done(cdm::FileIOClient::kSuccess, data_);
+        return;
+    }
+
+    reader_ = file_io;
+
+    if (state_ == State::kOpen)
+        run_queued_ops();
+    else
+        open(nullptr);
+}
+
+void
+Record::ReadComplete(GMPErr aStatus, const uint8_t *aData, uint32_t aDataSize)
+{
+    LOGF << format("storage::Record::ReadComplete aStatus=%1%, aData=%2%, aDataSize=%3%\n") %
+            aStatus % static_cast<const void *>(aData) % aDataSize;
+
+    read_in_flight_ = false;
+
+    std::vector<uint8_t> data;
+    if (GMP_SUCCEEDED(aStatus)) {
+        data.assign(aData, aData + aDataSize);
+
+        // a write issued meanwhile already replaced cached contents
+        if (!cached_) {
+            data_ = data;
+            cached_ = true;
+        }
+    }
+
+    if (reader_) {
+        reader_->read_done(to_FileIOClient_Status(aStatus), data);
+        reader_ = nullptr;
+    }
+
+    run_queued_ops();
+}
+
+void
+Record::write(FileIO *file_io, const uint8_t *data, uint32_t data_size)
+{
+    stats.writes ++;
+
+    if (take_flush_error()) {
+        file_io->write_done(cdm::FileIOClient::kError);
+        return;
+    }
+
+    // Cache reflects the latest write immediately, flush carries whatever is latest at the time
+    // it starts. Write completes as soon as it's cached, so the CDM rewriting a record through
+    // the same FileIO while a flush is in flight ends up in a single follow-up flush. If that
+    // flush fails, the next read or write of the record reports it.
+    if (data && data_size > 0)
+        data_.assign(data, data + data_size);
+    else
+        data_.clear();
+    cached_ = true;
+    known_names.insert(name_);
+
+    if (flush_pending_)
+        stats.writes_coalesced ++;
+
+    flush_pending_ = true;
+    file_io->write_done(cdm::FileIOClient::kSuccess);
+
+    switch (state_) {
+    case State::kOpen:
+        run_queued_ops();
+        break;
+
+    case State::kClosed:
+        open(nullptr);
+        break;
+
+    case State::kOpening:
+        break;
+    }
+}
+
+void
+Record::flush()
+{
+    LOGF << format("storage: flushing %1%, %2% bytes\n") % name_ % data_.size();
+
+    flush_pending_ = false;
+
+    count_round_trip();
+    write_in_flight_ = true;
+    GMPErr err = rec_->Write(data_.data(), data_.size());
+    if (GMP_FAILED(err))
+        WriteComplete(err);
+}
+
+void
+Record::WriteComplete(GMPErr aStatus)
+{
+    LOGF << format("storage::Record::WriteComplete aStatus=%1%\n") % aStatus;
+
+    write_in_flight_ = false;
+
+    if (GMP_FAILED(aStatus) && !flush_pending_) {
+        // stored contents are unknown now, next read should go to GMP
+        LOGZ << format("storage: record %1% not written, err=%2%\n") % name_ % aStatus;
+        flush_error_ = true;
+        cached_ = false;
+        data_.clear();
+    } else if (GMP_SUCCEEDED(aStatus)) {
+        flush_error_ = false;
+    }
+
+    run_queued_ops();
+}
+
+void
+Record::close_if_idle()
+{
+    if (state_ != State::kOpen || owner_ || reader_ || read_in_flight_ || write_in_flight_ ||
+        flush_pending_)
+    {
+        return;
+    }
+
+    rec_->Close();
+    rec_ = nullptr;
+    state_ = State::kClosed;
+}
+
+void
+record_iterator_cb(GMPRecordIterator *aRecordIterator, void *aUserArg, GMPErr aStatus)
+{
+    LOGF << format("storage::record_iterator_cb aRecordIterator=%1%, aStatus=%2%\n") %
+            aRecordIterator % aStatus;
+
+    if (GMP_FAILED(aStatus)) {
+        LOGZ << format("storage: can't enumerate records, err=%1%\n") % aStatus;
+        return;
+    }
+
+    const char *name;
+    uint32_t name_len;
+    while (GMP_SUCCEEDED(aRecordIterator->GetName(&name, &name_len))) {
+        known_names.insert(string(name, name_len));
+        aRecordIterator->NextRecord();
+    }
+
+    aRecordIterator->Close();
+    enumerated = true;
+
+    LOGF << format("   %1% records found\n") % known_names.size();
+}
+
+} // anonymous namespace
+
+void
+init()
+{
+    LOGF << "storage::init\n";
+
+    if (enumeration_started)
+        return;
+
+    GMPErr err = fxcdm::get_platform_api()->getrecordenumerator(record_iterator_cb, nullptr);
+    if (GMP_FAILED(err)) {
+        LOGZ << format("storage: getrecordenumerator failed, err=%1%\n") % err;
+        return;
+    }
+
+    enumeration_started = true;
+    count_round_trip();
+}
+
+cdm::FileIO *
+create_file_io(cdm::FileIOClient *client)
+{
+    return new FileIO(client);
+}
+
+void
+startup_done()
+{
+    stats.startup = false;
+}
+
+void
+log_stats()
+{
+    LOGS << format("storage: round trips: %1% (%2% before first license request), opens from "
+            "cache: %3%, reads from cache: %4%, writes: %5% (%6% coalesced)\n") %
+            stats.round_trips % stats.startup_round_trips % stats.opens_from_cache %
+            stats.reads_from_cache % stats.writes % stats.writes_coalesced;
+}
+
+} // namespace storage
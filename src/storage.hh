@@ -0,0 +1,55 @@
+/*
+ * Copyright © 2016  Rinat Ibragimov
+ *
+ * This file is part of gmp-widevine.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <api/crcdm/content_decryption_module.h>
+
+
+namespace storage {
+
+// Backs cdm::FileIO with GMP records. Record contents are cached in memory once read or
+// written, so CDM re-reading its certificate and license files doesn't cost an IPC round trip
+// each time. Writes complete once cached; those arriving while a previous flush of the same
+// record is still in flight, whether through the same FileIO or another one, are merged into
+// a single flush. Main thread only, as is GMP storage itself.
+
+// Starts fetching the list of stored records. Should be called before CDM is created.
+void
+init();
+
+cdm::FileIO *
+create_file_io(cdm::FileIOClient *client);
+
+// Ends the startup phase for round trip accounting. Called once the first license request goes
+// out, as everything storage-related before it delays playback start.
+void
+startup_done();
+
+void
+log_stats();
+
+} // namespace storage
@@ -0,0 +1,438 @@
+/*
+ * Copyright © 2016  Rinat Ibragimov
+ *
+ * This file is part of gmp-widevine.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "vpx.hh"
+#include <algorithm>
+
+
+namespace vpx {
+
+namespace {
+
+// Number of clear bytes in a sample, starting at |offset| and up to the next encrypted byte.
+size_t
+clear_bytes_at(const std::vector<cdm::SubsampleEntry> &subsamples, size_t data_size,
+               size_t offset)
+{
+    if (offset >= data_size)
+        return 0;
+
+    if (subsamples.empty())
+        return data_size - offset;
+
+    size_t start = 0;
+    for (const auto &e: subsamples) {
+        size_t clear_end = start + e.clear_bytes;
+
+        if (offset < start)
+            return 0;
+        if (offset < clear_end)
+            return std::min(clear_end, data_size) - offset;
+
+        start = clear_end + e.cipher_bytes;
+    }
+
+    return 0;
+}
+
+// Tells whether [offset, offset + len) lies entirely in clear parts of a sample.
+bool
+is_clear_range(const std::vector<cdm::SubsampleEntry> &subsamples, size_t offset, size_t len)
+{
+    if (subsamples.empty())
+        return true;
+
+    size_t start = 0;
+    for (const auto &e: subsamples) {
+        size_t clear_end = start + e.clear_bytes;
+
+        if (offset >= start && offset + len <= clear_end)
+            return true;
+        if (offset < clear_end + e.cipher_bytes)
+            return false;
+
+        start = clear_end + e.cipher_bytes;
+    }
+
+    return false;
+}
+
+// Boolean entropy decoder, as described in RFC 6386, section 7.3. Used to read VP8 frame
+// header, which is the first thing coded in the first partition.
+class BoolDecoder {
+public:
+    BoolDecoder(const uint8_t *data, size_t size)
+        : data_(data)
+        , end_(data + size)
+    {
+        value_ = (next_byte() << 8) | next_byte();
+    }
+
+    uint32_t
+    read_bool(uint32_t prob)
+    {
+        uint32_t split = 1 + (((range_ - 1) * prob) >> 8);
+        uint32_t big_split = split << 8;
+        uint32_t bit;
+
+        if (value_ >= big_split) {
+            bit = 1;
+            range_ -= split;
+            value_ -= big_split;
+        } else {
+            bit = 0;
+            range_ = split;
+        }
+
+        while (range_ < 128) {
+            value_ <<= 1;
+            range_ <<= 1;
+            if (++bit_count_ == 8) {
+                bit_count_ = 0;
+                value_ |= next_byte();
+            }
+        }
+
+        return bit;
+    }
+
+    // Reads |bits| wide unsigned literal, most significant bit first.
+    uint32_t
+    read(uint32_t bits)
+    {
+        uint32_t v = 0;
+        for (uint32_t k = 0; k < bits; k ++)
+            v = (v << 1) | read_bool(128);
+        return v;
+    }
+
+    // Skips optional field: flag, followed by |bits| wide value if flag is set.
+    void
+    skip_optional(uint32_t bits)
+    {
+        if (read(1))
+            read(bits);
+    }
+
+    // Decoder prefetches two bytes ahead of the bits it returns, so running one or two bytes
+    // past the end doesn't yet mean garbage was returned. Being strict here only costs
+    // falling back to the conservative answer.
+    bool
+    overrun() const { return overrun_; }
+
+private:
+    uint32_t
+    next_byte()
+    {
+        if (data_ >= end_) {
+            overrun_ = true;
+            return 0;
+        }
+        return *data_++;
+    }
+
+    const uint8_t  *data_;
+    const uint8_t  *end_;
+    uint32_t        value_ = 0;
+    uint32_t        range_ = 255;
+    uint32_t        bit_count_ = 0;
+    bool            overrun_ = false;
+};
+
+// Size of VP8 frame tag, RFC 6386, section 9.1.
+const size_t kVp8FrameTagSize = 3;
+
+// Reads frame header of a VP8 inter frame up to the reference buffer update flags
+// (RFC 6386, section 19.2). Returns false if header doesn't fit into |size| bytes.
+bool
+vp8_inter_frame_updates_references(const uint8_t *data, size_t size, bool &updates_references)
+{
+    BoolDecoder bd(data, size);
+
+    if (bd.read(1)) {                       // segmentation_enabled
+        uint32_t update_mb_segmentation_map = bd.read(1);
+        uint32_t update_segment_feature_data = bd.read(1);
+        if (update_segment_feature_data) {
+            bd.read(1);                     // segment_feature_mode
+            for (int k = 0; k < 4; k ++)
+                bd.skip_optional(7 + 1);    // quantizer_update_value, sign
+            for (int k = 0; k < 4; k ++)
+                bd.skip_optional(6 + 1);    // loop_filter_update_value, sign
+        }
+        if (update_mb_segmentation_map) {
+            for (int k = 0; k < 3; k ++)
+                bd.skip_optional(8);        // segment_prob
+        }
+    }
+
+    bd.read(1);                             // filter_type
+    bd.read(6);                             // loop_filter_level
+    bd.read(3);                             // sharpness_level
+
+    if (bd.read(1)) {                       // loop_filter_adj_enable
+        if (bd.read(1)) {                   // mode_ref_lf_delta_update
+            for (int k = 0; k < 8; k ++)
+                bd.skip_optional(6 + 1);    // ref_frame_delta and mb_mode_delta, with sign
+        }
+    }
+
+    bd.read(2);                             // log2_nbr_of_dct_partitions
+    bd.read(7);                             // y_ac_qi
+    for (int k = 0; k < 5; k ++)
+        bd.skip_optional(4 + 1);            // y_dc, y2_dc, y2_ac, uv_dc, uv_ac deltas
+
+    uint32_t refresh_golden_frame = bd.read(1);
+    uint32_t refresh_alternate_frame = bd.read(1);
+    uint32_t copy_buffer_to_golden = refresh_golden_frame ? 0 : bd.read(2);
+    uint32_t copy_buffer_to_alternate = refresh_alternate_frame ? 0 : bd.read(2);
+    bd.read(1);                             // sign_bias_golden
+    bd.read(1);                             // sign_bias_alternate
+    bd.read(1);                             // refresh_entropy_probs
+    uint32_t refresh_last = bd.read(1);
+
+    if (bd.overrun())
+        return false;
+
+    // Buffer copies are done with references as they were before this frame, so skipping
+    // the frame changes them too.
+    updates_references = refresh_golden_frame || refresh_alternate_frame || refresh_last ||
+                         copy_buffer_to_golden || copy_buffer_to_alternate;
+    return true;
+}
+
+class BitReader {
+public:
+    BitReader(const uint8_t *data, size_t size)
+        : data_(data)
+        , size_(size)
+    {}
+
+    uint32_t
+    read(uint32_t bits)
+    {
+        uint32_t v = 0;
+        for (uint32_t k = 0; k < bits; k ++) {
+            if (pos_ >= size_ * 8) {
+                overrun_ = true;
+                return 0;
+            }
+            v = (v << 1) | ((data_[pos_ / 8] >> (7 - pos_ % 8)) & 1);
+            pos_ ++;
+        }
+        return v;
+    }
+
+    bool
+    overrun() const { return overrun_; }
+
+private:
+    const uint8_t  *data_;
+    size_t          size_;
+    size_t          pos_ = 0;
+    bool            overrun_ = false;
+};
+
+// Longest prefix of VP9 uncompressed header examined below: frame marker, profile, flags,
+// sync code and color config of an intra-only frame, and refresh_frame_flags.
+const size_t kVp9HeaderPeekSize = 8;
+
+enum class Vp9Frame {
+    kInvalid,
+    kKey,
+    kReference,
+    kNonReference,
+};
+
+Vp9Frame
+inspect_vp9_uncompressed_header(const uint8_t *data, size_t size)
+{
+    BitReader br(data, size);
+
+    if (br.read(2) != 2)                    // frame_marker
+        return Vp9Frame::kInvalid;
+
+    uint32_t profile = br.read(1);
+    profile |= br.read(1) << 1;
+    if (profile == 3)
+        br.read(1);                         // reserved_zero
+
+    if (br.read(1))                         // show_existing_frame
+        return Vp9Frame::kNonReference;
+
+    uint32_t frame_type = br.read(1);
+    uint32_t show_frame = br.read(1);
+    uint32_t error_resilient_mode = br.read(1);
+
+    if (frame_type == 0)
+        return br.overrun() ? Vp9Frame::kInvalid : Vp9Frame::kKey;
+
+    uint32_t intra_only = show_frame ? 0 : br.read(1);
+    if (!error_resilient_mode)
+        br.read(2);                         // reset_frame_context
+
+    if (intra_only) {
+        if (br.read(24) != 0x498342)        // frame_sync_code
+            return Vp9Frame::kInvalid;
+
+        if (profile > 0) {
+            uint32_t bit_depth_bits = (profile >= 2) ? 1 : 0;
+            br.read(bit_depth_bits);
+            uint32_t color_space = br.read(3);
+            if (color_space != 7) {         // CS_RGB
+                br.read(1);                 // color_range
+                if (profile == 1 || profile == 3)
+                    br.read(3);             // subsampling_x, subsampling_y, reserved_zero
+            } else if (profile == 1 || profile == 3) {
+                br.read(1);                 // reserved_zero
+            }
+        }
+    }
+
+    uint32_t refresh_frame_flags = br.read(8);
+    if (br.overrun())
+        return Vp9Frame::kInvalid;
+
+    return refresh_frame_flags ? Vp9Frame::kReference : Vp9Frame::kNonReference;
+}
+
+} // anonymous namespace
+
+FrameInfo
+inspect_vp8_frame(const uint8_t *data, size_t data_size,
+                  const std::vector<cdm::SubsampleEntry> &subsamples)
+{
+    FrameInfo info;
+
+    if (data_size < kVp8FrameTagSize || !is_clear_range(subsamples, 0, kVp8FrameTagSize))
+        return info;
+
+    info.parsed = true;
+    info.is_key_frame = (data[0] & 1) == 0;     // frame tag, key_frame bit is inverted
+    uint32_t show_frame = (data[0] >> 4) & 1;
+    uint32_t first_part_size = (data[0] >> 5) | (data[1] << 3) | (data[2] << 11);
+
+    // Key frames replace all references, and hidden frames exist only to update them.
+    if (info.is_key_frame || !show_frame)
+        return info;
+
+    size_t first_part_clear = std::min<size_t>(first_part_size,
+                                  clear_bytes_at(subsamples, data_size, kVp8FrameTagSize));
+    bool updates_references;
+    if (vp8_inter_frame_updates_references(data + kVp8FrameTagSize, first_part_clear,
+                                           updates_references))
+    {
+        info.is_reference = updates_references;
+    }
+
+    return info;
+}
+
+bool
+parse_vp9_superframe_index(const uint8_t *data, size_t data_size,
+                           const std::vector<cdm::SubsampleEntry> &subsamples,
+                           std::vector<uint32_t> &frame_sizes)
+{
+    frame_sizes.clear();
+
+    if (data_size < 1 || !is_clear_range(subsamples, data_size - 1, 1))
+        return false;
+
+    uint8_t marker = data[data_size - 1];
+    if ((marker & 0xe0) != 0xc0)
+        return false;
+
+    uint32_t frames = (marker & 7) + 1;
+    uint32_t mag = ((marker >> 3) & 3) + 1;
+    size_t index_size = 2 + mag * frames;
+
+    if (data_size < index_size || !is_clear_range(subsamples, data_size - index_size, index_size))
+        return false;
+
+    if (data[data_size - index_size] != marker)
+        return false;
+
+    const uint8_t *p = data + data_size - index_size + 1;
+    size_t total = 0;
+    for (uint32_t k = 0; k < frames; k ++) {
+        uint32_t sz = 0;
+        for (uint32_t b = 0; b < mag; b ++)
+            sz |= uint32_t(*p++) << (b * 8);
+        frame_sizes.push_back(sz);
+        total += sz;
+    }
+
+    if (total > data_size - index_size) {
+        frame_sizes.clear();
+        return false;
+    }
+
+    return true;
+}
+
+FrameInfo
+inspect_vp9_frame(const uint8_t *data, size_t data_size,
+                  const std::vector<cdm::SubsampleEntry> &subsamples)
+{
+    FrameInfo info;
+    std::vector<uint32_t> frame_sizes;
+
+    if (!parse_vp9_superframe_index(data, data_size, subsamples, frame_sizes))
+        frame_sizes.assign(1, data_size);
+
+    info.frame_count = frame_sizes.size();
+    info.is_reference = false;
+
+    size_t offset = 0;
+    for (size_t k = 0; k < frame_sizes.size(); k ++) {
+        size_t peek = std::min<size_t>(kVp9HeaderPeekSize, frame_sizes[k]);
+
+        if (!is_clear_range(subsamples, offset, peek))
+            return FrameInfo();
+
+        switch (inspect_vp9_uncompressed_header(data + offset, peek)) {
+        case Vp9Frame::kInvalid:
+            return FrameInfo();
+
+        case Vp9Frame::kKey:
+            if (k == 0)
+                info.is_key_frame = true;
+            info.is_reference = true;
+            break;
+
+        case Vp9Frame::kReference:
+            info.is_reference = true;
+            break;
+
+        case Vp9Frame::kNonReference:
+            break;
+        }
+
+        offset += frame_sizes[k];
+    }
+
+    info.parsed = true;
+    return info;
+}
+
+} // namespace vpx
@@ -0,0 +1,62 @@
+/*
+ * Copyright © 2016  Rinat Ibragimov
+ *
+ * This file is part of gmp-widevine.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+#include <api/crcdm/content_decryption_module.h>
+
+
+namespace vpx {
+
+struct FrameInfo {
+    bool        parsed = false;         // frame headers were found and examined
+    bool        is_key_frame = false;
+    bool        is_reference = true;    // frame updates at least one reference buffer
+    uint32_t    frame_count = 1;        // number of frames in VP9 superframe
+};
+
+// Looks at VP8 frame tag, and for shown inter frames, at reference buffer update flags in the
+// frame header. These are coded in the first partition; if it's not clear far enough, the frame
+// is assumed to be a reference one.
+FrameInfo
+inspect_vp8_frame(const uint8_t *data, size_t data_size,
+                  const std::vector<cdm::SubsampleEntry> &subsamples);
+
+// Looks at uncompressed headers of a VP9 frame or of every frame in a VP9 superframe. Headers
+// are expected to be clear, as required by CENC; if some of them are encrypted, |parsed| is false.
+FrameInfo
+inspect_vp9_frame(const uint8_t *data, size_t data_size,
+                  const std::vector<cdm::SubsampleEntry> &subsamples);
+
+// Extracts frame sizes from VP9 superframe index. Returns false if there is no valid index, in
+// which case buffer contains a single frame. Index is only parsed if it's clear.
+bool
+parse_vp9_superframe_index(const uint8_t *data, size_t data_size,
+                           const std::vector<cdm::SubsampleEntry> &subsamples,
+                           std::vector<uint32_t> &frame_sizes);
+
+} // namespace vpx